@@ -0,0 +1,249 @@
+#include <errno.h>
+#include <getopt.h>
+#include <math.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <time.h>
+
+#define GEN_BUF_LEN (1 << 20)        // bytes formatted before each fwrite
+#define GEN_LINE_LEN 128             // longest line the generator emits
+#define GEN_EPOCH 1769385600         // 2026-01-26 00:00:00 UTC
+#define GEN_WINDOW (2 * 24 * 3600)   // timestamps fall in two days from GEN_EPOCH
+
+// Field values weighted roughly like the logs in ./logs
+static const char *const methods[] = {
+    "GET", "GET", "GET", "GET", "GET", "GET", "GET", "GET", "GET", "GET",
+    "GET", "GET", "GET", "GET", "POST", "POST", "POST", "HEAD", "PUT", "DELETE",
+};
+static const char *const statuses[] = {
+    "200", "200", "200", "200", "200", "200", "200", "200", "200", "200",
+    "200", "200", "200", "200", "302", "400", "401", "404", "404", "500",
+};
+static const char *const routes[] = {
+    "/",
+    "/about",
+    "/blog",
+    "/blog/post1",
+    "/cart",
+    "/careers",
+    "/categories",
+    "/categories/art",
+    "/categories/books",
+    "/categories/education",
+    "/categories/education/courses",
+    "/categories/education/online",
+    "/categories/philosophy",
+    "/checkout",
+    "/contact",
+    "/login",
+    "/products",
+    "/search",
+    "/unsub",
+};
+#define N_METHODS (sizeof(methods) / sizeof(methods[0]))
+#define N_STATUSES (sizeof(statuses) / sizeof(statuses[0]))
+#define N_ROUTES (sizeof(routes) / sizeof(routes[0]))
+
+// splitmix64, small and good enough to make every run byte for byte the same
+static uint64_t next_random(uint64_t *state) {
+  uint64_t z = (*state += 0x9e3779b97f4a7c15ull);
+  z = (z ^ (z >> 30)) * 0xbf58476d1ce4e5b9ull;
+  z = (z ^ (z >> 27)) * 0x94d049bb133111ebull;
+  return z ^ (z >> 31);
+}
+
+// Uniform double in [0, 1)
+static double next_unit(uint64_t *state) {
+  return (next_random(state) >> 11) * (1.0 / 9007199254740992.0);
+}
+
+// Spread IP ranks over the address space, an odd multiplier is a
+// bijection on 32 bits, so every rank gets its own IP and the popular
+// ones are not all in one network
+static uint32_t rank_to_ip(uint64_t rank) {
+  return (uint32_t)(rank * 2654435761u + 0x0a000001u);
+}
+
+// Cumulative Zipf weights of ranks 0..n_ips-1 with the given exponent
+static double *zipf_cdf(uint64_t n_ips, double skew) {
+  double *cdf = malloc(n_ips * sizeof(double));
+  if (cdf == NULL) {
+    return NULL;
+  }
+  double sum = 0;
+  for (uint64_t i = 0; i < n_ips; i++) {
+    sum += 1.0 / pow((double)(i + 1), skew);
+    cdf[i] = sum;
+  }
+  for (uint64_t i = 0; i < n_ips; i++) {
+    cdf[i] /= sum;
+  }
+  return cdf;
+}
+
+// Pick an IP rank, uniformly if cdf is NULL
+static uint64_t pick_rank(uint64_t *state, const double *cdf, uint64_t n_ips) {
+  if (cdf == NULL) {
+    return next_random(state) % n_ips;
+  }
+  double u = next_unit(state);
+  uint64_t lo = 0, hi = n_ips - 1;
+  while (lo < hi) {
+    uint64_t mid = lo + (hi - lo) / 2;
+    if (cdf[mid] < u) {
+      lo = mid + 1;
+    } else {
+      hi = mid;
+    }
+  }
+  return lo;
+}
+
+// Parse a byte count with an optional k, m or g suffix
+static int parse_size(const char *arg, unsigned long long *size) {
+  char *end;
+  unsigned long long value = strtoull(arg, &end, 10);
+  if (end == arg) {
+    return -1;
+  }
+  const char *suffixes = "kmg";
+  const char *suffix = *end ? strchr(suffixes, *end | 0x20) : NULL;
+  if (suffix != NULL) {
+    value <<= 10 * (suffix - suffixes + 1);
+    end++;
+  }
+  if (*end != '\0') {
+    return -1;
+  }
+  *size = value;
+  return 0;
+}
+
+// Write about size bytes of whole log lines to path
+static int write_log(const char *path, unsigned long long size,
+                     uint64_t *state, const double *cdf, uint64_t n_ips) {
+  FILE *fp = fopen(path, "w");
+  if (fp == NULL) {
+    perror("fopen");
+    return -1;
+  }
+  char *buf = malloc(GEN_BUF_LEN);
+  if (buf == NULL) {
+    fclose(fp);
+    return -1;
+  }
+
+  unsigned long long written = 0;
+  size_t len = 0;
+  while (written + len < size) {
+    if (len > GEN_BUF_LEN - GEN_LINE_LEN) {
+      if (fwrite(buf, 1, len, fp) != len) {
+        perror("fwrite");
+        free(buf);
+        fclose(fp);
+        return -1;
+      }
+      written += len;
+      len = 0;
+    }
+    time_t when = GEN_EPOCH + (time_t)(next_random(state) % GEN_WINDOW);
+    struct tm tm;
+    gmtime_r(&when, &tm);
+    len += strftime(buf + len, GEN_LINE_LEN, "%Y-%m-%d %H:%M:%S", &tm);
+
+    uint32_t ip = rank_to_ip(pick_rank(state, cdf, n_ips));
+    uint64_t r = next_random(state);
+    len += sprintf(buf + len, ",%u.%u.%u.%u,%s,%s,%s\n", ip >> 24,
+                   (ip >> 16) & 0xff, (ip >> 8) & 0xff, ip & 0xff,
+                   methods[r % N_METHODS], routes[(r >> 16) % N_ROUTES],
+                   statuses[(r >> 32) % N_STATUSES]);
+  }
+  int ret = 0;
+  if (len > 0 && fwrite(buf, 1, len, fp) != len) {
+    perror("fwrite");
+    ret = -1;
+  }
+  free(buf);
+  if (fclose(fp) != 0) {
+    perror("fclose");
+    ret = -1;
+  }
+  return ret;
+}
+
+static void usage(void) {
+  fprintf(stderr, "Usage: log_gen [--files n] [--size bytes[k|m|g]] "
+                  "[--ips n] [--skew s] [--seed n] <out dir>\n");
+}
+
+// Generate synthetic logs in the timestamp,ip,method,route,status format
+// of ./logs. The same options always produce the same files. --size is
+// per file, --ips the number of distinct addresses to draw from and
+// --skew the Zipf exponent of their popularity, 0 for uniform.
+int main(int argc, char *argv[]) {
+  static const struct option options[] = {
+      {"files", required_argument, NULL, 'f'},
+      {"size", required_argument, NULL, 's'},
+      {"ips", required_argument, NULL, 'i'},
+      {"skew", required_argument, NULL, 'z'},
+      {"seed", required_argument, NULL, 'r'},
+      {NULL, 0, NULL, 0},
+  };
+  int n_files = 4;
+  unsigned long long size = 1 << 20;
+  uint64_t n_ips = 100000;
+  double skew = 0;
+  uint64_t seed = 1;
+  int opt;
+  while ((opt = getopt_long(argc, argv, "", options, NULL)) != -1) {
+    if (opt == 'f') {
+      n_files = atoi(optarg);
+    } else if (opt == 's' && parse_size(optarg, &size) == 0) {
+      // size is set
+    } else if (opt == 'i') {
+      n_ips = strtoull(optarg, NULL, 10);
+    } else if (opt == 'z') {
+      skew = strtod(optarg, NULL);
+    } else if (opt == 'r') {
+      seed = strtoull(optarg, NULL, 10);
+    } else {
+      usage();
+      return 1;
+    }
+  }
+  if (argc - optind != 1 || n_files < 1 || n_ips < 1 || skew < 0) {
+    usage();
+    return 1;
+  }
+
+  const char *dir = argv[optind];
+  if (mkdir(dir, 0777) < 0 && errno != EEXIST) {
+    perror("mkdir");
+    return 1;
+  }
+
+  double *cdf = NULL;
+  if (skew > 0) {
+    cdf = zipf_cdf(n_ips, skew);
+    if (cdf == NULL) {
+      fprintf(stderr, "malloc failed\n");
+      return 1;
+    }
+  }
+
+  for (int f = 0; f < n_files; f++) {
+    // every file has its own stream, so adding files keeps the others
+    uint64_t state = seed * 1000003u + f;
+    char path[1024];
+    snprintf(path, sizeof(path), "%s/%d.log", dir, f);
+    if (write_log(path, size, &state, cdf, n_ips) != 0) {
+      free(cdf);
+      return 1;
+    }
+  }
+  free(cdf);
+  return 0;
+}
@@ -0,0 +1,78 @@
+#!/bin/sh
+# Throughput of mapreduce over generated logs, run from the project root
+# with `make bench`. Settings come from the environment:
+#   BENCH_FILES  log files to generate (8)
+#   BENCH_SIZE   bytes per file, k, m or g suffix allowed (16m)
+#   BENCH_IPS    distinct IPs to draw from (100000)
+#   BENCH_SKEW   Zipf exponent of IP popularity, 0 for uniform (0)
+#   BENCH_GRID   <mappers>x<reducers> pairs to run ("1x1 2x2 4x4 8x4")
+#   BENCH_MODES  mapreduce flags per mode, "-" for none ("- -d -p -o")
+#   BENCH_RUNS   runs of every configuration, the fastest is kept (3)
+#   BENCH_OUT    results file (bench/results.tsv)
+# Logs are only generated again when the settings change. Every mode
+# needs --stats, so --threads cannot be benchmarked here. The results
+# file has one tab separated line per configuration, so the files of
+# two versions can be diffed.
+
+FILES=${BENCH_FILES:-8}
+SIZE=${BENCH_SIZE:-16m}
+IPS=${BENCH_IPS:-100000}
+SKEW=${BENCH_SKEW:-0}
+GRID=${BENCH_GRID:-"1x1 2x2 4x4 8x4"}
+MODES=${BENCH_MODES:-"- -d -p -o"}
+RUNS=${BENCH_RUNS:-3}
+OUT=${BENCH_OUT:-bench/results.tsv}
+
+DATA=bench/data/${FILES}x${SIZE}-${IPS}-${SKEW}
+STATS=bench/data/stats.json
+
+# mapreduce reads every file in the directory, so the marker of a
+# finished generation sits next to it
+if [ ! -f "$DATA.done" ]; then
+  echo "bench: generating $FILES x $SIZE of logs in $DATA"
+  rm -rf "$DATA"
+  mkdir -p bench/data
+  ./bench/log_gen --files "$FILES" --size "$SIZE" --ips "$IPS" \
+    --skew "$SKEW" "$DATA" || exit 1
+  touch "$DATA.done"
+fi
+mkdir -p intermediate out
+
+VERSION=$(git describe --always --dirty 2>/dev/null || echo unknown)
+{
+  echo "# version $VERSION, $FILES files of $SIZE, $IPS ips, skew $SKEW, best of $RUNS"
+  printf "mode\tmappers\treducers\tlines\twall_sec\tlines_per_sec"
+  printf "\tscan_sec\tmap_sec\treduce_sec\toutput_sec\tpeak_rss_kb\n"
+} > "$OUT"
+
+for mode in $MODES; do
+  flags=$mode
+  [ "$mode" = "-" ] && flags=
+  for pair in $GRID; do
+    mappers=${pair%x*}
+    reducers=${pair#*x}
+    best=
+    run=0
+    while [ "$run" -lt "$RUNS" ]; do
+      ./mapreduce $flags --stats "$STATS" "$DATA" "$mappers" "$reducers" \
+        > /dev/null || exit 1
+      # the report is written by mapreduce in a fixed layout
+      line=$(awk -v mode="$mode" -v m="$mappers" -v r="$reducers" '
+        /"phases"/ { gsub(/[{},:"]/, " "); scan = $3; map = $5;
+                     reduce = $7; output = $9 }
+        /"total"/  { gsub(/[{},:"]/, " "); wall = $3; lines = $7;
+                     rss = $17 }
+        END { rate = wall > 0 ? lines / wall : 0
+              printf "%s\t%s\t%s\t%s\t%.3f\t%.0f\t%.3f\t%.3f\t%.3f\t%.3f\t%s\n",
+                     mode, m, r, lines, wall, rate, scan, map, reduce, output,
+                     rss }' "$STATS")
+      if [ -z "$best" ] || awk -v a="$(echo "$line" | cut -f5)" \
+          -v b="$(echo "$best" | cut -f5)" 'BEGIN { exit !(a < b) }'; then
+        best=$line
+      fi
+      run=$((run + 1))
+    done
+    echo "$best" | tee -a "$OUT"
+  done
+done
+rm -f "$STATS"
@@ -0,0 +1,225 @@
+#include <dirent.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include "../include/table.h"
+
+#define MAX_PROBE_BIN 8    // last histogram bin collects every longer probe
+
+typedef uint32_t (*hash_fn)(uint32_t key);
+
+// Character sum of the dotted string, the original hash_ip
+static uint32_t hash_char_sum(uint32_t key) {
+  char ip[IP_LEN];
+  key_to_ip(key, ip);
+  uint32_t sum = 0;
+  for (int i = 0; ip[i] != '\0'; i++) {
+    sum += (unsigned char)ip[i];
+  }
+  return sum;
+}
+
+// FNV-1a over the dotted string
+static uint32_t hash_fnv1a(uint32_t key) {
+  char ip[IP_LEN];
+  key_to_ip(key, ip);
+  uint32_t hash = 2166136261u;
+  for (int i = 0; ip[i] != '\0'; i++) {
+    hash ^= (unsigned char)ip[i];
+    hash *= 16777619u;
+  }
+  return hash;
+}
+
+static double now_sec() {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+// Append the IP of every parsable line in file_path to keys
+static int load_keys(const char *file_path, uint32_t **keys, size_t *count,
+                     size_t *cap) {
+  FILE *fp = fopen(file_path, "r");
+  if (fp == NULL) {
+    perror("fopen");
+    return -1;
+  }
+  char line[1024];
+  while (fgets(line, sizeof(line), fp)) {
+    char *ip = strchr(line, ',');
+    if (ip == NULL) {
+      continue;
+    }
+    ip++;
+    char *end = strchr(ip, ',');
+    if (end == NULL) {
+      continue;
+    }
+    *end = '\0';
+    uint32_t key;
+    if (ip_to_key(ip, &key) != 0) {
+      continue;
+    }
+    if (*count == *cap) {
+      *cap = *cap ? *cap * 2 : 4096;
+      uint32_t *grown = realloc(*keys, *cap * sizeof(uint32_t));
+      if (grown == NULL) {
+        fclose(fp);
+        return -1;
+      }
+      *keys = grown;
+    }
+    (*keys)[(*count)++] = key;
+  }
+  fclose(fp);
+  return 0;
+}
+
+// Print the histogram of bins, where bins[n] counts keys with a chain or
+// probe length of n, along with the average length per key and the longest
+static void print_histogram(const char *name, const size_t *bins,
+                            size_t keys, size_t total, size_t longest) {
+  printf("%-16s avg %6.2f  max %7zu  |", name,
+         keys ? (double)total / keys : 0.0, longest);
+  for (int n = 1; n <= MAX_PROBE_BIN; n++) {
+    printf(" %s%d:%zu", n == MAX_PROBE_BIN ? ">=" : "", n, bins[n]);
+  }
+  printf("\n");
+}
+
+// Hash the distinct keys of table into n_chains chained buckets and print
+// how many keys sit in a chain of each length. The average is the length
+// of the chain an average key lives in, which is what lookups walk.
+static void chain_histogram(const char *name, hash_fn hash,
+                            const table_t *table, size_t n_chains) {
+  size_t *chains = calloc(n_chains, sizeof(size_t));
+  if (chains == NULL) {
+    return;
+  }
+  for (size_t i = 0; i < table->count; i++) {
+    chains[hash(table->buckets[i]->key) % n_chains]++;
+  }
+  size_t bins[MAX_PROBE_BIN + 1] = {0};
+  size_t total = 0, longest = 0;
+  for (size_t i = 0; i < n_chains; i++) {
+    size_t len = chains[i];
+    bins[len < MAX_PROBE_BIN ? len : MAX_PROBE_BIN] += len;
+    total += len * len;
+    if (len > longest) {
+      longest = len;
+    }
+  }
+  free(chains);
+  print_histogram(name, bins, table->count, total, longest);
+}
+
+// Print the real probe length of every key in table, the distance from the
+// slot its hash maps to and the slot it ended up in
+static void probe_histogram(const table_t *table) {
+  size_t mask = table->capacity - 1;
+  size_t bins[MAX_PROBE_BIN + 1] = {0};
+  size_t total = 0, longest = 0;
+  for (size_t pos = 0; pos < table->capacity; pos++) {
+    if (table->slots[pos].idx < 0) {
+      continue;
+    }
+    size_t home = hash_key(table->slots[pos].key) & mask;
+    size_t probes = ((pos - home) & mask) + 1;
+    bins[probes < MAX_PROBE_BIN ? probes : MAX_PROBE_BIN]++;
+    total += probes;
+    if (probes > longest) {
+      longest = probes;
+    }
+  }
+  print_histogram("table probes", bins, table->count, total, longest);
+}
+
+int main(int argc, char *argv[]) {
+  const char *dir_name = argc > 1 ? argv[1] : "./logs";
+  size_t synthetic = argc > 2 ? strtoul(argv[2], NULL, 10) : 0;
+
+  DIR *dir = opendir(dir_name);
+  if (dir == NULL) {
+    perror("opendir");
+    return 1;
+  }
+  uint32_t *keys = NULL;
+  size_t count = 0, cap = 0;
+  struct dirent *entry;
+  while ((entry = readdir(dir)) != NULL) {
+    if (strcmp(entry->d_name, ".") == 0 || strcmp(entry->d_name, "..") == 0) {
+      continue;
+    }
+    char path[MAX_PATH * 2];
+    snprintf(path, sizeof(path), "%s/%s", dir_name, entry->d_name);
+    if (load_keys(path, &keys, &count, &cap) != 0) {
+      closedir(dir);
+      free(keys);
+      return 1;
+    }
+  }
+  closedir(dir);
+
+  // Consecutive addresses in 10.0.0.0/8, the worst case for weak hashes
+  if (synthetic > 0) {
+    uint32_t *grown = realloc(keys, (count + synthetic) * sizeof(uint32_t));
+    if (grown == NULL) {
+      free(keys);
+      return 1;
+    }
+    keys = grown;
+    for (size_t i = 0; i < synthetic; i++) {
+      keys[count++] = 0x0a000000u + (uint32_t)i;
+    }
+  }
+
+  table_t *table = table_init();
+  if (table == NULL) {
+    free(keys);
+    return 1;
+  }
+
+  double start = now_sec();
+  for (size_t i = 0; i < count; i++) {
+    bucket_t *bucket = table_get_key(table, keys[i]);
+    if (bucket == NULL) {
+      bucket = table_add_key(table, keys[i]);
+      if (bucket == NULL) {
+        table_free(table);
+        free(keys);
+        return 1;
+      }
+    }
+    bucket->requests++;
+  }
+  double build = now_sec() - start;
+
+  start = now_sec();
+  size_t found = 0;
+  for (size_t i = 0; i < count; i++) {
+    found += table_get_key(table, keys[i]) != NULL;
+  }
+  double lookup = now_sec() - start;
+
+  printf("keys %zu  distinct %zu  capacity %zu  load %.2f\n", count,
+         table->count, table->capacity,
+         (double)table->count / table->capacity);
+  printf("build  %.0f ops/sec\n", build > 0 ? count / build : 0.0);
+  printf("lookup %.0f lookups/sec (%zu found)\n",
+         lookup > 0 ? count / lookup : 0.0, found);
+  printf("chain lengths, keys per chain length:\n");
+  chain_histogram("char-sum % 17", hash_char_sum, table, 17);
+  chain_histogram("char-sum", hash_char_sum, table, table->capacity);
+  chain_histogram("fnv1a", hash_fnv1a, table, table->capacity);
+  chain_histogram("hash_key", hash_key, table, table->capacity);
+  printf("linear probe lengths at capacity %zu, keys per probe length:\n",
+         table->capacity);
+  probe_histogram(table);
+
+  table_free(table);
+  free(keys);
+  return 0;
+}
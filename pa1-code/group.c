@@ -0,0 +1,603 @@
+#include "./include/group.h"
+
+#include <math.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "./include/map.h"
+
+#define GROUP_INIT_CAP 1024    // initial slot count, must be a power of two
+#define TIMESTAMP_LEN 19       // "YYYY-MM-DD HH:MM:SS"
+
+static const char *const field_names[GROUP_MAX_FIELDS] = {
+    "ip", "route", "method", "status", "time",
+};
+
+// The log field every group field is taken from
+static const log_field_t field_sources[GROUP_MAX_FIELDS] = {
+    LOG_IP, LOG_ROUTE, LOG_METHOD, LOG_STATUS, LOG_TIMESTAMP,
+};
+
+// Methods counted on their own in an aggregate, the rest share the last slot
+static const char *const method_names[GROUP_N_METHODS - 1] = {
+    "GET", "POST", "PUT", "DELETE", "HEAD", "PATCH",
+};
+
+int group_parse(const char *spec, int metrics, group_spec_t *group) {
+  memset(group, 0, sizeof(*group));
+  group->bucket_sec = GROUP_TIME_BUCKET;
+  group->metrics = metrics;
+  if (metrics) {
+    group->n_split = LOG_N_FIELDS;
+  }
+
+  const char *p = spec;
+  while (*p != '\0') {
+    size_t len = strcspn(p, ",");
+    size_t name_len = strcspn(p, ",:");
+    int field = -1;
+    for (int f = 0; f < GROUP_MAX_FIELDS; f++) {
+      if (strlen(field_names[f]) == name_len &&
+          strncmp(p, field_names[f], name_len) == 0) {
+        field = f;
+      }
+    }
+    if (field < 0 || group->n_fields == GROUP_MAX_FIELDS) {
+      return -1;
+    }
+    for (int i = 0; i < group->n_fields; i++) {
+      if (group->fields[i] == (group_field_t)field) {
+        return -1;
+      }
+    }
+    if (name_len < len) {
+      // only time takes an argument, the bucket width
+      char *end;
+      long sec = strtol(p + name_len + 1, &end, 10);
+      if (field != GROUP_TIME || end != p + len || sec <= 0) {
+        return -1;
+      }
+      group->bucket_sec = sec;
+    }
+    group->fields[group->n_fields++] = (group_field_t)field;
+    if ((int)field_sources[field] + 1 > group->n_split) {
+      group->n_split = field_sources[field] + 1;
+    }
+    p += len;
+    if (*p == ',' && *++p == '\0') {
+      return -1;
+    }
+  }
+  return group->n_fields > 0 ? 0 : -1;
+}
+
+// Days since 1970-01-01 of a date in the proleptic Gregorian calendar
+static long days_from_civil(long y, long m, long d) {
+  y -= m <= 2;
+  long era = (y >= 0 ? y : y - 399) / 400;
+  long yoe = y - era * 400;
+  long doy = (153 * (m + (m > 2 ? -3 : 9)) + 2) / 5 + d - 1;
+  long doe = yoe * 365 + yoe / 4 - yoe / 100 + doy;
+  return era * 146097 + doe - 719468;
+}
+
+// Inverse of days_from_civil
+static void civil_from_days(long z, long *y, long *m, long *d) {
+  z += 719468;
+  long era = (z >= 0 ? z : z - 146096) / 146097;
+  long doe = z - era * 146097;
+  long yoe = (doe - doe / 1460 + doe / 36524 - doe / 146096) / 365;
+  long doy = doe - (365 * yoe + yoe / 4 - yoe / 100);
+  long mp = (5 * doy + 2) / 153;
+  *d = doy - (153 * mp + 2) / 5 + 1;
+  *m = mp < 10 ? mp + 3 : mp - 9;
+  *y = yoe + era * 400 + (*m <= 2);
+}
+
+// Parse the n digits at s
+static int parse_digits(const char *s, int n, long *value) {
+  *value = 0;
+  for (int i = 0; i < n; i++) {
+    if (s[i] < '0' || s[i] > '9') {
+      return -1;
+    }
+    *value = *value * 10 + (s[i] - '0');
+  }
+  return 0;
+}
+
+// Check a "YYYY-MM-DD HH:MM:SS" timestamp and split it into its date and
+// its second of the day, which is 86400 for a leap second at midnight
+static int parse_clock(const char *ts, size_t len, long *y, long *mo, long *d,
+                       long *sod) {
+  long h, mi, s;
+  if (len != TIMESTAMP_LEN || ts[4] != '-' || ts[7] != '-' || ts[10] != ' ' ||
+      ts[13] != ':' || ts[16] != ':' || parse_digits(ts, 4, y) != 0 ||
+      parse_digits(ts + 5, 2, mo) != 0 || parse_digits(ts + 8, 2, d) != 0 ||
+      parse_digits(ts + 11, 2, &h) != 0 || parse_digits(ts + 14, 2, &mi) != 0 ||
+      parse_digits(ts + 17, 2, &s) != 0 || *mo < 1 || *mo > 12 || *d < 1 ||
+      *d > 31 || h > 23 || mi > 59 || s > 60) {
+    return -1;
+  }
+  *sod = h * 3600 + mi * 60 + s;
+  return 0;
+}
+
+// Parse a "YYYY-MM-DD HH:MM:SS" timestamp into seconds since the epoch
+static int parse_time(const char *ts, size_t len, long long *t) {
+  long y, mo, d, sod;
+  if (parse_clock(ts, len, &y, &mo, &d, &sod) != 0) {
+    return -1;
+  }
+  *t = (long long)days_from_civil(y, mo, d) * 86400 + sod;
+  return 0;
+}
+
+// Write two digits of value at out
+static void put_digits(char *out, long value) {
+  out[0] = (char)('0' + value / 10);
+  out[1] = (char)('0' + value % 10);
+}
+
+// Write seconds since the epoch to out as a timestamp with sep between
+// the date and the time. Every field is written with a fixed number of
+// digits, so the timestamp always fills TIMESTAMP_LEN bytes.
+static int format_time(long long t, char sep, char out[TIMESTAMP_LEN + 1]) {
+  long long days = t >= 0 ? t / 86400 : (t - 86399) / 86400;
+  long secs = (long)(t - days * 86400);
+  long y, mo, d;
+  civil_from_days((long)days, &y, &mo, &d);
+  if (y < 0 || y > 9999) {
+    return -1;
+  }
+  put_digits(out, y / 100);
+  put_digits(out + 2, y % 100);
+  out[4] = '-';
+  put_digits(out + 5, mo);
+  out[7] = '-';
+  put_digits(out + 8, d);
+  out[10] = sep;
+  put_digits(out + 11, secs / 3600);
+  out[13] = ':';
+  put_digits(out + 14, secs / 60 % 60);
+  out[16] = ':';
+  put_digits(out + 17, secs % 60);
+  out[TIMESTAMP_LEN] = '\0';
+  return 0;
+}
+
+// Round a "YYYY-MM-DD HH:MM:SS" timestamp down to the start of its
+// bucket and write it back in the same form to out
+//
+// Buckets that divide a day, such as minutes and hours, never cross
+// midnight, so the date is copied as is and only the clock is rounded.
+// Other widths go through seconds since the epoch.
+static int bucket_time(const char *ts, size_t len, long bucket_sec,
+                       char out[TIMESTAMP_LEN + 1]) {
+  long y, mo, d, sod;
+  if (parse_clock(ts, len, &y, &mo, &d, &sod) != 0) {
+    return -1;
+  }
+  if (86400 % bucket_sec == 0 && sod < 86400) {
+    sod -= sod % bucket_sec;
+    memcpy(out, ts, 11);
+    put_digits(out + 11, sod / 3600);
+    out[13] = ':';
+    put_digits(out + 14, sod / 60 % 60);
+    out[16] = ':';
+    put_digits(out + 17, sod % 60);
+    out[TIMESTAMP_LEN] = '\0';
+    return 0;
+  }
+  long long t = (long long)days_from_civil(y, mo, d) * 86400 + sod;
+  t -= ((t % bucket_sec) + bucket_sec) % bucket_sec;
+  return format_time(t, ' ', out);
+}
+
+void aggregate_init(aggregate_t *agg) {
+  memset(agg, 0, sizeof(*agg));
+  agg->first_seen = UINT32_MAX;
+}
+
+void aggregate_merge(aggregate_t *into, const aggregate_t *from) {
+  into->client_errors += from->client_errors;
+  into->server_errors += from->server_errors;
+  for (int m = 0; m < GROUP_N_METHODS; m++) {
+    into->methods[m] += from->methods[m];
+  }
+  if (from->first_seen < into->first_seen) {
+    into->first_seen = from->first_seen;
+  }
+  if (from->last_seen > into->last_seen) {
+    into->last_seen = from->last_seen;
+  }
+  for (int j = 0; j < GROUP_ROUTE_REGISTERS; j++) {
+    if (from->routes[j] > into->routes[j]) {
+      into->routes[j] = from->routes[j];
+    }
+  }
+}
+
+// Add a route to the HyperLogLog registers of agg. The top bits of its
+// hash pick a register, which keeps the longest run of leading zeros
+// seen in the remaining bits.
+static void aggregate_route(aggregate_t *agg, const char *route, size_t len) {
+  uint32_t hash = hash_key(table_checksum(TABLE_CHECKSUM_INIT, route, len));
+  uint32_t j = hash >> (32 - GROUP_ROUTE_BITS);
+  uint32_t rest = hash << GROUP_ROUTE_BITS;
+  uint8_t rank = 1;
+  while (rank <= 32 - GROUP_ROUTE_BITS && !(rest & 0x80000000u)) {
+    rest <<= 1;
+    rank++;
+  }
+  if (rank > agg->routes[j]) {
+    agg->routes[j] = rank;
+  }
+}
+
+long aggregate_routes(const aggregate_t *agg) {
+  const double m = GROUP_ROUTE_REGISTERS;
+  double sum = 0;
+  int zeros = 0;
+  for (int j = 0; j < GROUP_ROUTE_REGISTERS; j++) {
+    sum += ldexp(1.0, -agg->routes[j]);
+    zeros += agg->routes[j] == 0;
+  }
+  if (zeros == GROUP_ROUTE_REGISTERS) {
+    return 0;
+  }
+  // bias correction of the raw estimate for m registers
+  double alpha = m <= 16   ? 0.673
+                 : m <= 32 ? 0.697
+                 : m <= 64 ? 0.709
+                           : 0.7213 / (1 + 1.079 / m);
+  double estimate = alpha * m * m / sum;
+  // linear counting is far closer while most registers are still empty
+  if (estimate <= 2.5 * m && zeros > 0) {
+    estimate = m * log(m / zeros);
+  }
+  return lround(estimate);
+}
+
+// Split a log line into the first n_split fields, skipping leading blanks
+static int group_split(const group_spec_t *group, const char *line,
+                       size_t len, log_span_t fields[LOG_N_FIELDS]) {
+  while (len > 0 && (*line == ' ' || *line == '\t')) {
+    line++;
+    len--;
+  }
+  return log_split(line, len, fields, group->n_split);
+}
+
+// Build the composite key from the fields of a split line
+static int build_key(const group_spec_t *group, const log_span_t fields[],
+                     char key[GROUP_KEY_LEN]) {
+  size_t used = 0;
+  for (int i = 0; i < group->n_fields; i++) {
+    const log_span_t *span = &fields[field_sources[group->fields[i]]];
+    char buf[TIMESTAMP_LEN + 1];
+    const char *text = span->start;
+    size_t text_len = span->len;
+    if (group->fields[i] == GROUP_IP) {
+      uint32_t ip;
+      if (ip_to_key_n(span->start, span->len, &ip) != 0) {
+        return -1;
+      }
+      key_to_ip(ip, buf);
+      text = buf;
+      text_len = strlen(buf);
+    } else if (group->fields[i] == GROUP_TIME) {
+      if (bucket_time(span->start, span->len, group->bucket_sec, buf) != 0) {
+        return -1;
+      }
+      text = buf;
+      text_len = TIMESTAMP_LEN;
+    }
+    // room for the text, a separator or the null terminator
+    if (used + text_len + 1 > GROUP_KEY_LEN) {
+      return -1;
+    }
+    if (i > 0) {
+      key[used++] = ',';
+    }
+    memcpy(key + used, text, text_len);
+    used += text_len;
+  }
+  key[used] = '\0';
+  return 0;
+}
+
+int group_key(const group_spec_t *group, const char *line, size_t len,
+              char key[GROUP_KEY_LEN]) {
+  log_span_t fields[LOG_N_FIELDS];
+  if (group_split(group, line, len, fields) != 0) {
+    return -1;
+  }
+  return build_key(group, fields, key);
+}
+
+// Fill agg with the aggregate of the single request of a split line
+static int line_aggregate(const log_span_t fields[], aggregate_t *agg) {
+  const log_span_t *ts = &fields[LOG_TIMESTAMP];
+  long long t;
+  if (parse_time(ts->start, ts->len, &t) != 0 || t < 0 || t >= UINT32_MAX) {
+    return -1;
+  }
+  aggregate_init(agg);
+  agg->first_seen = (uint32_t)t;
+  agg->last_seen = (uint32_t)t;
+
+  const log_span_t *status = &fields[LOG_STATUS];
+  if (status->len == 3 && status->start[0] == '4') {
+    agg->client_errors = 1;
+  } else if (status->len == 3 && status->start[0] == '5') {
+    agg->server_errors = 1;
+  }
+
+  const log_span_t *method = &fields[LOG_METHOD];
+  int m = 0;
+  while (m < GROUP_N_METHODS - 1 &&
+         (strlen(method_names[m]) != method->len ||
+          memcmp(method_names[m], method->start, method->len) != 0)) {
+    m++;
+  }
+  agg->methods[m] = 1;
+
+  aggregate_route(agg, fields[LOG_ROUTE].start, fields[LOG_ROUTE].len);
+  return 0;
+}
+
+uint32_t hash_group(const char *key) {
+  return hash_key(table_checksum(TABLE_CHECKSUM_INIT, key, strlen(key)));
+}
+
+size_t group_record_size(int metrics) {
+  return metrics ? sizeof(aggregate_record_t) : sizeof(group_record_t);
+}
+
+group_record_t *group_record_at(void *records, size_t i, int metrics) {
+  return (group_record_t *)((char *)records + i * group_record_size(metrics));
+}
+
+group_table_t *group_table_init(int metrics) {
+  group_table_t *table = malloc(sizeof(group_table_t));
+  if (table == NULL) {
+    return NULL;
+  }
+  table->record_size = group_record_size(metrics);
+  table->slots = calloc(GROUP_INIT_CAP, table->record_size);
+  if (table->slots == NULL) {
+    free(table);
+    return NULL;
+  }
+  table->count = 0;
+  table->capacity = GROUP_INIT_CAP;
+  table->metrics = metrics;
+  return table;
+}
+
+void group_table_free(group_table_t *table) {
+  if (table == NULL) {
+    return;
+  }
+  free(table->slots);
+  free(table);
+}
+
+// Return slot i of a group table
+static group_record_t *group_slot(const group_table_t *table, size_t i) {
+  return group_record_at(table->slots, i, table->metrics);
+}
+
+// Double the slot array and reinsert every record
+static int group_grow(group_table_t *table) {
+  size_t capacity = table->capacity * 2;
+  size_t size = table->record_size;
+  char *slots = calloc(capacity, size);
+  if (slots == NULL) {
+    return -1;
+  }
+  size_t mask = capacity - 1;
+  for (size_t i = 0; i < table->capacity; i++) {
+    const group_record_t *record = group_slot(table, i);
+    if (record->key[0] == '\0') {
+      continue;
+    }
+    size_t pos = record->hash & mask;
+    while (group_record_at(slots, pos, table->metrics)->key[0] != '\0') {
+      pos = (pos + 1) & mask;
+    }
+    memcpy(slots + pos * size, record, size);
+  }
+  free(table->slots);
+  table->slots = slots;
+  table->capacity = capacity;
+  return 0;
+}
+
+int group_table_add(group_table_t *table, const char *key, int requests,
+                    const aggregate_t *agg) {
+  if (table == NULL || key == NULL || key[0] == '\0' ||
+      strlen(key) >= GROUP_KEY_LEN || (table->metrics && agg == NULL)) {
+    return -1;
+  }
+  if ((table->count + 1) * TABLE_LOAD_DEN > table->capacity * TABLE_LOAD_NUM &&
+      group_grow(table) != 0) {
+    return -1;
+  }
+  uint32_t hash = hash_group(key);
+  size_t mask = table->capacity - 1;
+  size_t pos = hash & mask;
+  group_record_t *record;
+  while ((record = group_slot(table, pos))->key[0] != '\0') {
+    if (record->hash == hash && strcmp(record->key, key) == 0) {
+      record->requests += requests;
+      if (table->metrics) {
+        aggregate_merge(&((aggregate_record_t *)record)->agg, agg);
+      }
+      return 0;
+    }
+    pos = (pos + 1) & mask;
+  }
+  record->hash = hash;
+  record->requests = requests;
+  strncpy(record->key, key, GROUP_KEY_LEN);
+  if (table->metrics) {
+    ((aggregate_record_t *)record)->agg = *agg;
+  }
+  table->count++;
+  return 0;
+}
+
+int group_line(group_table_t *table, const group_spec_t *group,
+               const char *line, size_t len) {
+  log_span_t fields[LOG_N_FIELDS];
+  char key[GROUP_KEY_LEN];
+  if (group_split(group, line, len, fields) != 0 ||
+      build_key(group, fields, key) != 0) {
+    return 1;
+  }
+  if (!group->metrics) {
+    return group_table_add(table, key, 1, NULL);
+  }
+  aggregate_t agg;
+  if (line_aggregate(fields, &agg) != 0) {
+    return 1;
+  }
+  return group_table_add(table, key, 1, &agg);
+}
+
+// Order records by hash, then by key
+static int cmp_hash(const void *a, const void *b) {
+  const group_record_t *ra = a;
+  const group_record_t *rb = b;
+  if (ra->hash != rb->hash) {
+    return ra->hash < rb->hash ? -1 : 1;
+  }
+  return strcmp(ra->key, rb->key);
+}
+
+int group_to_file(group_table_t *table, const char out_file[MAX_PATH]) {
+  if (table == NULL || out_file == NULL) {
+    return -1;
+  }
+  size_t size = table->record_size;
+  size_t n = 0;
+  for (size_t i = 0; i < table->capacity; i++) {
+    if (group_slot(table, i)->key[0] != '\0') {
+      memmove(group_slot(table, n++), group_slot(table, i), size);
+    }
+  }
+  qsort(table->slots, n, size, cmp_hash);
+
+  table_header_t header;
+  table_header_init(&header,
+                    table->metrics ? TABLE_KEY_AGGREGATE : TABLE_KEY_GROUP);
+  return table_write(out_file, &header, table->slots, n, size);
+}
+
+void *group_read_range(const char in_file[MAX_PATH], uint64_t start,
+                       uint64_t end, int metrics, size_t *count) {
+  table_header_t header;
+  return table_read_keys(in_file,
+                         metrics ? TABLE_KEY_AGGREGATE : TABLE_KEY_GROUP,
+                         group_record_size(metrics), start, end, &header,
+                         count);
+}
+
+static int cmp_key(const void *a, const void *b) {
+  return strcmp(((const group_record_t *)a)->key,
+                ((const group_record_t *)b)->key);
+}
+
+// Print the aggregates of a record after its count
+static int print_metrics(FILE *fp, const aggregate_t *agg) {
+  char first[TIMESTAMP_LEN + 1] = "-";
+  char last[TIMESTAMP_LEN + 1] = "-";
+  if (agg->last_seen > 0) {
+    format_time(agg->first_seen, 'T', first);
+    format_time(agg->last_seen, 'T', last);
+  }
+  if (fprintf(fp, " client_errors=%d server_errors=%d routes=%ld",
+              agg->client_errors, agg->server_errors,
+              aggregate_routes(agg)) < 0) {
+    return -1;
+  }
+  for (int m = 0; m < GROUP_N_METHODS; m++) {
+    if (fprintf(fp, " %s=%d", m < GROUP_N_METHODS - 1 ? method_names[m] : "other",
+                agg->methods[m]) < 0) {
+      return -1;
+    }
+  }
+  return fprintf(fp, " first_seen=%s last_seen=%s", first, last) < 0 ? -1 : 0;
+}
+
+int group_print(FILE *fp, void *records, size_t count, int metrics) {
+  qsort(records, count, group_record_size(metrics), cmp_key);
+  for (size_t i = 0; i < count; i++) {
+    const group_record_t *record = group_record_at(records, i, metrics);
+    if (fprintf(fp, "%s - %d", record->key, record->requests) < 0 ||
+        (metrics &&
+         print_metrics(fp, &((const aggregate_record_t *)record)->agg) != 0) ||
+        fputc('\n', fp) == EOF) {
+      perror("fprintf");
+      return -1;
+    }
+  }
+  return 0;
+}
+
+int group_write_windows(void *records, size_t count, int metrics,
+                        const char *dir) {
+  record_t *window = malloc((count ? count : 1) * sizeof(record_t));
+  if (window == NULL) {
+    return -1;
+  }
+  int n_windows = 0;
+  size_t i = 0;
+  while (i < count) {
+    // records of a window are adjacent, their keys share the timestamp
+    const char *ts = group_record_at(records, i, metrics)->key;
+    size_t n = 0;
+    for (; i + n < count; n++) {
+      const group_record_t *record = group_record_at(records, i + n, metrics);
+      const char *key = record->key;
+      if (strncmp(key, ts, TIMESTAMP_LEN) != 0) {
+        break;
+      }
+      if (key[TIMESTAMP_LEN] != ',' ||
+          ip_to_key(key + TIMESTAMP_LEN + 1, &window[n].key) != 0) {
+        fprintf(stderr, "group: %s is not a time,ip key\n", key);
+        free(window);
+        return -1;
+      }
+      window[n].requests = record->requests;
+    }
+    records_sort(window, n);
+
+    // "YYYY-MM-DD HH:MM:SS" becomes "YYYY-MM-DDTHHMMSS"
+    char path[MAX_PATH];
+    snprintf(path, sizeof(path), "%s/%.10sT%.2s%.2s%.2s.tbl", dir, ts, ts + 11,
+             ts + 14, ts + 17);
+    table_writer_t *writer = table_writer_open(path);
+    if (writer == NULL) {
+      free(window);
+      return -1;
+    }
+    for (size_t k = 0; k < n; k++) {
+      if (table_writer_add(writer, &window[k]) != 0) {
+        table_writer_abort(writer);
+        free(window);
+        return -1;
+      }
+    }
+    if (table_writer_close(writer) != 0) {
+      free(window);
+      return -1;
+    }
+    n_windows++;
+    i += n;
+  }
+  free(window);
+  return n_windows;
+}
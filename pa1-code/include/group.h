@@ -0,0 +1,172 @@
+#ifndef GROUP_H
+#define GROUP_H
+
+#include <stdint.h>
+#include <stdio.h>
+
+#include "./table.h"
+
+#define GROUP_KEY_LEN 120          // longest composite key including the null terminator
+#define GROUP_MAX_FIELDS 5         // ip, route, method, status and time
+#define GROUP_TIME_BUCKET 3600     // seconds per time bucket unless the spec says otherwise
+#define GROUP_N_METHODS 7          // GET, POST, PUT, DELETE, HEAD, PATCH and the rest
+#define GROUP_ROUTE_BITS 6         // log2 of the registers estimating distinct routes
+#define GROUP_ROUTE_REGISTERS (1 << GROUP_ROUTE_BITS)
+
+// A dimension a job can group requests by
+typedef enum group_field {
+    GROUP_IP,
+    GROUP_ROUTE,
+    GROUP_METHOD,
+    GROUP_STATUS,
+    GROUP_TIME
+} group_field_t;
+
+// Parsed group-by specification, the fields of a composite key in order
+typedef struct group_spec {
+    group_field_t fields[GROUP_MAX_FIELDS];
+    int n_fields;
+    int n_split;        // leading log fields a line must have
+    long bucket_sec;    // width of a GROUP_TIME bucket in seconds
+    int metrics;        // fill in every aggregate, not just requests
+} group_spec_t;
+
+// Aggregates of the requests under one key besides their count. Every
+// field combines associatively with aggregate_merge, so mappers, reducers
+// and the final merge can add up partial aggregates in any order.
+typedef struct aggregate {
+    int client_errors;          // 4xx responses
+    int server_errors;          // 5xx responses
+    int methods[GROUP_N_METHODS];
+    uint32_t first_seen;        // earliest timestamp in seconds since the epoch
+    uint32_t last_seen;         // latest timestamp, 0 if there was none
+    uint8_t routes[GROUP_ROUTE_REGISTERS];    // HyperLogLog of the routes
+} aggregate_t;
+
+// Definition of a composite key and its count, both the entry of a group
+// table and the record of a group table file
+//
+// key holds the requested fields of a line joined by commas, such as
+// "10.0.0.1,GET" for ip,method. The hash of key is the shuffle key, so
+// reducers own ranges of hashes instead of ranges of IPs.
+typedef struct group_record {
+    uint32_t hash;      // hash_group of key
+    int requests;
+    char key[GROUP_KEY_LEN];
+} group_record_t;
+
+// Definition of a composite key with every aggregate, the record of group
+// tables and files with metrics, with key encoding TABLE_KEY_AGGREGATE.
+// It starts with a group_record_t, so both layouts share the code that
+// only needs the key, its hash and its count.
+typedef struct aggregate_record {
+    group_record_t group;
+    aggregate_t agg;
+} aggregate_record_t;
+
+// Open addressing hash table of composite keys, records are stored in
+// the slots themselves and a slot is empty while its key is ""
+//
+// Slots are group_record_t, or aggregate_record_t with metrics, so a job
+// that only counts keeps its records small.
+typedef struct group_table {
+    char *slots;
+    size_t record_size;    // group_record_size(metrics)
+    size_t count;
+    size_t capacity;       // always a power of two
+    int metrics;
+} group_table_t;
+
+// Parse a group-by specification, a comma separated list of ip, route,
+// method, status and time, where time:<seconds> sets the bucket width.
+// With metrics every aggregate is computed, and lines must have every
+// log field.
+//
+// Return 0 on success, -1 if spec is empty, has an unknown or repeated
+// field or a bad bucket width
+int group_parse(const char *spec, int metrics, group_spec_t *group);
+
+// Reset agg to the aggregate of no requests
+void aggregate_init(aggregate_t *agg);
+
+// Add the aggregate from to into
+void aggregate_merge(aggregate_t *into, const aggregate_t *from);
+
+// Return the estimated number of distinct routes of an aggregate
+long aggregate_routes(const aggregate_t *agg);
+
+// Build the composite key of a log line of len bytes
+//
+// Timestamps are rounded down to the start of their bucket and IPs are
+// checked and written in canonical form.
+//
+// Return 0 on success, -1 if the line lacks a field, has an invalid IP
+// or timestamp, or its key would not fit in GROUP_KEY_LEN
+int group_key(const group_spec_t *group, const char *line, size_t len,
+              char key[GROUP_KEY_LEN]);
+
+// Return the hash of a composite key
+uint32_t hash_group(const char *key);
+
+// Return the size of a record with or without metrics
+size_t group_record_size(int metrics);
+
+// Return record i of an array of records with or without metrics
+group_record_t *group_record_at(void *records, size_t i, int metrics);
+
+// Allocate an empty group table, whose records carry every aggregate
+// with metrics and only the count otherwise
+//
+// Return the table on success, NULL on failure
+group_table_t *group_table_init(int metrics);
+
+// Free a group table
+void group_table_free(group_table_t *table);
+
+// Add requests to the count of key, inserting it if it is new, and merge
+// agg into its aggregate if the table has metrics
+//
+// Return 0 on success, -1 on failure or if agg is missing with metrics
+int group_table_add(group_table_t *table, const char *key, int requests,
+                    const aggregate_t *agg);
+
+// Count a single log line of len bytes, without the newline, under its
+// composite key
+//
+// Return 0 if the line was counted, 1 if it had no key and was skipped,
+// -1 if it could not be added
+int group_line(group_table_t *table, const group_spec_t *group,
+               const char *line, size_t len);
+
+// Write a group table to out_file as a table file with key encoding
+// TABLE_KEY_GROUP, or TABLE_KEY_AGGREGATE with metrics, its records
+// sorted by hash and then key. The table is
+// compacted and sorted in place and must not be added to afterwards.
+//
+// Return 0 on success, -1 on failure
+int group_to_file(group_table_t *table, const char out_file[MAX_PATH]);
+
+// Read the records of a group table file whose hash is in [start, end)
+// into a new array. The file must have metrics exactly if metrics is
+// set. The checksums of the blocks read are verified.
+//
+// Return the records on success with their number in count, NULL on failure
+void *group_read_range(const char in_file[MAX_PATH], uint64_t start,
+                       uint64_t end, int metrics, size_t *count);
+
+// Sort records by key and print every one as a "key - requests" line.
+// With metrics the line goes on with name=value pairs of the other
+// aggregates, timestamps written as YYYY-MM-DDTHH:MM:SS.
+//
+// Return 0 on success, -1 on failure
+int group_print(FILE *fp, void *records, size_t count, int metrics);
+
+// Write records keyed by time,ip and sorted by key as one IPv4 table per
+// time bucket, named <dir>/YYYY-MM-DDTHHMMSS.tbl after the start of the
+// bucket, with the request count of every IP in it
+//
+// Return the number of tables written on success, -1 on failure
+int group_write_windows(void *records, size_t count, int metrics,
+                        const char *dir);
+
+#endif    // GROUP_H
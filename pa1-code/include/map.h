@@ -1,7 +1,26 @@
 #ifndef MAP_H
 #define MAP_H
 
+#include <sys/types.h>
+
+#include "./group.h"
+#include "./stats.h"
 #include "./table.h"
+#include "./topk.h"
+
+// Size of a task record on a mapper work queue, a null padded `file` or
+// `file:offset:length` argument. Must stay under PIPE_BUF so that every
+// record is written and read from a pipe atomically.
+#define TASK_LEN 1088
+
+// Worst case bytes of memory per distinct IP in a mapper table, a slab
+// bucket plus its slot and index entry right after the table has doubled
+#define MAP_BYTES_PER_KEY \
+  (sizeof(bucket_t) + \
+   (sizeof(slot_t) + sizeof(bucket_t *)) * 2 * TABLE_LOAD_DEN / TABLE_LOAD_NUM)
+
+#define MAP_MIN_SPILL_KEYS 1024 // never spill runs smaller than this
+#define MAP_MAX_RUNS 64          // merge spilled runs once this many exist
 
 // update with what log lines have
 typedef struct log_line {
@@ -12,9 +31,117 @@ typedef struct log_line {
     char status[4];
 } log_line_t;
 
+// Comma separated fields of a log line, in the order they appear
+typedef enum log_field {
+    LOG_TIMESTAMP,
+    LOG_IP,
+    LOG_METHOD,
+    LOG_ROUTE,
+    LOG_STATUS,
+    LOG_N_FIELDS
+} log_field_t;
+
+// A field of a log line, pointing into the line instead of a copy
+typedef struct log_span {
+    const char *start;
+    size_t len;
+} log_span_t;
+
+// Split the first n_fields comma separated fields of a line in place.
+// Fields are found with memchr and never copied, and nothing past the
+// last requested field is scanned, so counting IPs never touches the
+// route or status. The last requested field ends at the next comma or
+// at the end of the line.
+//
+// Return 0 on success, -1 if the line has fewer than n_fields fields
+// or one of them is empty
+int log_split(const char *line, size_t len, log_span_t fields[], int n_fields);
+
+// Count the request in a single log line of len bytes, without the newline
+//
+// If a memory budget was set with map_set_budget and the table outgrows
+// it, the table is spilled to a sorted run and emptied.
+//
+// Return 0 if the line was counted, 1 if it could not be parsed and was
+// skipped, -1 if counting it failed, such as when its bucket could not
+// be allocated or the table could not be spilled
+int map_line(table_t *table, const char *line, size_t len);
+
+// Limit the table of this mapper to about budget bytes, 0 for no limit.
+// Whenever it holds more IPs than fit in the budget it is written to a
+// sorted run file named after out_file and cleared.
+//
+// Selected with `map --memory <bytes>[k|m|g] <outfile> <infiles...>`
+void map_set_budget(size_t budget, const char out_file[MAX_PATH]);
+
+// Add the lines, rejected lines and bytes read by every later map call
+// to stats, or stop counting if stats is NULL. Only lines map_line could
+// not parse are rejected, a line it fails to count fails the mapper
+// instead. Mappers running on threads share these counters, so only set
+// it in a map process.
+//
+// Selected with `map --stats <file> <outfile> <infiles...>`
+void map_set_stats(stats_t *stats);
+
+// Count every later line under its composite key in group instead of
+// under its IP in the table passed to the map functions, or go back to
+// counting IPs if group is NULL
+//
+// Selected with `map --group <spec> <outfile> <infiles...>`
+void map_set_group(group_table_t *group, const group_spec_t *spec);
+
+// Count every later IP in the Space-Saving summary topk instead of in
+// the table passed to the map functions, so the memory of the mapper
+// stays fixed however many IPs there are, or go back to the table if
+// topk is NULL
+//
+// Selected with `map --top-k <capacity> <outfile> <infiles...>`
+void map_set_topk(topk_t *topk);
+
+// Write the table to out_file. If any runs were spilled, the table is
+// spilled as a last run and all runs are merged into out_file with
+// table_merge, then removed.
+//
+// Return 0 on success, -1 on failure or if an earlier spill failed
+int map_finish(table_t *table, const char out_file[MAX_PATH]);
+
 // The main driver of the mappers
 //
+// `map --queue <fd> <outfile>` pulls TASK_LEN task records from fd until
+// it is drained instead of (or after) the inputs given on the command line
+//
 // Read all files and map user requests
 int map_log(table_t* table, const char file_path[MAX_PATH]);
 
+// Same as map_log, but mmaps regular files and parses lines straight
+// out of the mapping instead of copying them through stdio.
+// Pipes and other files that cannot be mapped are streamed instead.
+//
+// Selected with `map --mmap <outfile> <infiles...>`
+int map_log_mmap(table_t* table, const char file_path[MAX_PATH]);
+
+// Count only the length bytes of file_path starting at offset, or
+// everything after offset when length is -1. mapreduce picks offsets on
+// line boundaries so no line is split across two chunks. Regular files
+// are mmapped when use_mmap is set, anything else is streamed.
+//
+// Selected by passing an input as `file:offset:length`
+int map_chunk(table_t* table, const char file_path[MAX_PATH], off_t offset,
+              off_t length, int use_mmap);
+
+// Send the table to n_pipes reducers instead of writing a file. Pipe r
+// gets the sorted records with keys in [KEY_SPLIT(r, n), KEY_SPLIT(r + 1, n))
+// as a record stream and is closed afterwards.
+//
+// Selected with `map --pipes <fd,fd,...> <infiles...>`
+//
+// Return 0 on success, -1 on failure
+int map_finish_pipes(table_t *table, const int fds[], int n_pipes);
+
+// Map one input argument, either a plain file or a `file:offset:length`
+// chunk. arg is split in place.
+//
+// Return 0 on success, -1 on failure
+int map_input(table_t *table, char *arg, int use_mmap);
+
 #endif // MAP_H
\ No newline at end of file
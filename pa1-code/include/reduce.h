@@ -3,7 +3,76 @@
 
 #include "./table.h"
 
-int reduce_file(table_t *table, const char file_path[MAX_PATH], const int start_ip,
-                const int end_ip);
+// Parse a reducer range bound, either a first octet (so 100 means
+// 100.0.0.0 and 256 means the end of the address space) or a full
+// dotted IP address
+//
+// Return 0 on success, -1 if bound is neither
+int parse_bound(const char *bound, uint64_t *key);
+
+// Add the counts of every IP in [start_key, end_key) of a table file to table,
+// after checking the checksums of the octets that cover the range
+//
+// Return 0 on success, 1 on failure
+int reduce_file(table_t *table, const char file_path[MAX_PATH],
+                const uint64_t start_key, const uint64_t end_key);
+
+// Merge the records in [start_key, end_key) of every table file in
+// dir_name into out_file with table_merge. Memory use grows with the
+// number of files, not with the number of distinct IPs. n_read, if not
+// NULL, is set to the number of records merged.
+//
+// Return 0 on success, 1 on failure
+int reduce_merge(const char dir_name[MAX_PATH], const char out_file[MAX_PATH],
+                 const uint64_t start_key, const uint64_t end_key,
+                 size_t *n_read);
+
+// Merge the sorted record streams mappers write to the pipes fds, as
+// they arrive, into out_file with table_merge_runs. Keys outside
+// [start_key, end_key) are dropped. n_read, if not NULL, is set to the
+// number of records merged.
+//
+// Selected with `reduce --pipes <fd,fd,...> <out file> <start ip> <end ip>`
+//
+// Return 0 on success, 1 on failure
+int reduce_pipes(const int fds[], int n_fds, const char out_file[MAX_PATH],
+                 const uint64_t start_key, const uint64_t end_key,
+                 size_t *n_read);
+
+// Add the records in [start_key, end_key) of every table file named on
+// a line of fd to a table as the lines arrive, then write the table to
+// out_file once fd reaches EOF. Lets a reducer start on the tables of
+// the mappers that are done while the rest are still running.
+//
+// Selected with `reduce --manifest <fd> <out file> <start ip> <end ip>`
+//
+// Return 0 on success, 1 on failure
+int reduce_manifest(int fd, const char out_file[MAX_PATH],
+                    const uint64_t start_key, const uint64_t end_key);
+
+// Add up the composite keys whose hash is in [start_key, end_key) of
+// every group table file in dir_name and write them to out_file as a
+// group table, with every aggregate if metrics is set. n_read, if not
+// NULL, is set to the number of records read.
+//
+// Selected with `reduce --group [--aggregates] <read dir> <out file>
+// <start> <end>`
+//
+// Return 0 on success, 1 on failure
+int reduce_group(const char dir_name[MAX_PATH], const char out_file[MAX_PATH],
+                 const uint64_t start_key, const uint64_t end_key, int metrics,
+                 size_t *n_read);
+
+// Merge the counters whose key is in [start_key, end_key) of every
+// summary file in dir_name with topk_merge and write the capacity
+// largest to out_file as a summary. n_read, if not NULL, is set to the
+// number of counters read.
+//
+// Selected with `reduce --top-k <capacity> <read dir> <out file> <start> <end>`
+//
+// Return 0 on success, 1 on failure
+int reduce_topk(const char dir_name[MAX_PATH], const char out_file[MAX_PATH],
+                const uint64_t start_key, const uint64_t end_key,
+                size_t capacity, size_t *n_read);
 
 #endif    // REDUCE_H
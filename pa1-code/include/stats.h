@@ -0,0 +1,43 @@
+#ifndef STATS_H
+#define STATS_H
+
+#include <stdio.h>
+
+// Counters one map or reduce process, or a whole mapreduce job, reports
+// with --stats. Fields a process has nothing to count for stay 0.
+typedef struct stats {
+  double start;              // wall clock at stats_start, in seconds
+  double wall_sec;           // wall time from stats_start to stats_stop
+  double cpu_sec;            // user + system time
+  long long lines;           // log lines parsed
+  long long rejected;        // malformed log lines skipped by the parser
+  long long bytes_read;      // log bytes for mappers, record bytes for reducers
+  long long bytes_written;   // table or record stream bytes
+  long long keys;            // distinct IPs written
+  long peak_rss_kb;          // largest resident set size
+} stats_t;
+
+// Seconds on the monotonic clock
+double stats_now(void);
+
+// Zero stats and start its wall clock
+void stats_start(stats_t *stats);
+
+// Fill in wall time, CPU time and peak RSS of this process, and of its
+// waited for children as well if with_children is set
+void stats_stop(stats_t *stats, int with_children);
+
+// Write stats to fp as a single line JSON object, without a newline
+void stats_print(FILE *fp, const stats_t *stats);
+
+// Write stats to path as JSON with stats_print
+//
+// Return 0 on success, -1 on failure
+int stats_write(const char *path, const stats_t *stats);
+
+// Read back a file written by stats_write
+//
+// Return 0 on success, -1 on failure
+int stats_read(const char *path, stats_t *stats);
+
+#endif    // STATS_H
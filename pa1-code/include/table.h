@@ -1,34 +1,155 @@
 #ifndef TABLE_H
 #define TABLE_H
 
-#define MAX_PATH 255    // max path length
-#define TABLE_LEN 17    // keep hash table array length a prime number for better hashing
-#define IP_LEN 16       // max ip length including null terminator
+#include <stddef.h>
+#include <stdint.h>
+#include <stdio.h>
 
-// Definition of a "bucket" node in a hash table
+#define MAX_PATH 255           // max path length
+#define TABLE_INIT_CAP 16      // initial slot count, must be a power of two
+#define TABLE_LOAD_NUM 3       // grow once count / capacity exceeds 3/4
+#define TABLE_LOAD_DEN 4
+#define IP_LEN 16              // max ip length including null terminator
+#define TABLE_INDEX_LEN 256    // entries in a .tbl file index, one per first octet
+#define TABLE_FENCE_LEN 256    // records per fence, the unit range reads check
+// Number of fences after count records, one per started block
+#define TABLE_FENCES(count) \
+    (((uint64_t)(count) + TABLE_FENCE_LEN - 1) / TABLE_FENCE_LEN)
+#define KEY_SPACE (1ull << 32) // exclusive upper bound of every key range
+// Start of the i-th of n even slices of the key space, KEY_SPACE for i == n
+#define KEY_SPLIT(i, n) ((uint64_t)(i) * KEY_SPACE / (uint64_t)(n))
+#define TABLE_MAGIC 0x4c425450u // "PTBL" at the start of every .tbl file
+#define TABLE_VERSION 7         // bump whenever the file layout changes
+#define TABLE_KEY_IPV4 1        // keys are IPv4 addresses packed by ip_to_key
+#define TABLE_KEY_GROUP 2       // group_record_t records of composite keys, see group.h
+#define TABLE_KEY_TOPK 3        // topk_entry_t counters of IPv4 keys, see topk.h
+#define TABLE_KEY_AGGREGATE 4   // aggregate_record_t records of composite keys, see group.h
+#define TABLE_CHECKSUM_INIT 2166136261u // FNV-1a offset basis
+#define TABLE_SLAB_MIN 64       // buckets in the first slab of a table
+#define TABLE_SLAB_MAX 65536    // slabs double in size up to this many buckets
+#define PRINT_BUF_LEN 65536     // bytes records_print formats before each write
+#define RECORD_LINE_LEN 32      // longest "ip - requests\n" line records_print emits
+
+// Definition of a "bucket", the entry for a single IP in a hash table
 //
-// Essentially, this is a linked list that resides at every index of the hash table
+// Buckets never move once allocated, so a pointer returned by table_get
+// stays valid while the table grows. The table only ever compares and
+// hashes key, the dotted quad is formatted with key_to_ip when printing.
 typedef struct bucket {
-    struct bucket *next;
-    char ip[IP_LEN];
+    uint32_t key;    // IPv4 address packed in host byte order
     int requests;
 } bucket_t;
 
+// Definition of an open addressing slot
+//
+// The packed key is kept next to the index so that probing never
+// has to touch the bucket itself
+typedef struct slot {
+    uint32_t key;
+    int32_t idx;    // index into table->buckets, -1 if the slot is empty
+} slot_t;
+
+// Definition of a record in a .tbl file, 8 bytes per IP
+typedef struct record {
+    uint32_t key;
+    int requests;
+} record_t;
+
+// Definition of the header at the start of a .tbl file
+//
+// The header is followed by exactly count records, sorted by key and
+// packed with no padding. The records whose first octet is o are records
+// [index[o], index[o + 1]). A reducer can then seek straight to the key
+// range it owns instead of reading every record of every mapper, so
+// reduce I/O stays linear in the reducer count.
+//
+// checksum is the FNV-1a hash of the record bytes. Fields are stored in
+// host byte order, tables are not meant to move between machines.
+typedef struct table_header {
+    uint32_t magic;           // TABLE_MAGIC
+    uint16_t version;         // TABLE_VERSION
+    uint16_t key_encoding;    // TABLE_KEY_IPV4
+    uint32_t count;           // number of records after the header
+    uint32_t checksum;        // FNV-1a of the records
+    uint32_t floor;           // TABLE_KEY_TOPK: bound on the count of absent keys, else 0
+    uint32_t index[TABLE_INDEX_LEN + 1];
+} table_header_t;
+
+// Definition of a fence in a .tbl file
+//
+// The records are followed by TABLE_FENCES(count) fences, fence b for the
+// block of records [b * TABLE_FENCE_LEN, (b + 1) * TABLE_FENCE_LEN). A
+// reader of a key range bisects the fences of its octets for the blocks
+// holding the range, reads only those and checks each against its
+// checksum, so a narrow range costs a few blocks rather than whole octets.
+typedef struct table_fence {
+    uint32_t key;         // key of the first record of the block
+    uint32_t checksum;    // FNV-1a of the records of the block
+} table_fence_t;
+
+// Definition of a slab of buckets owned by a table
+typedef struct slab {
+    struct slab *next;    // the previous, smaller slab
+    size_t used;
+    size_t cap;
+    bucket_t buckets[];
+} slab_t;
+
 // Definition of table
+//
+// buckets is a dense array of every bucket in insertion order, iterate
+// it with `for (size_t i = 0; i < table->count; i++)`.
+// slots is a linear probing index over buckets, capacity is always a
+// power of two so a hash maps to a slot with a mask.
+//
+// Buckets created with table_add_key are bump allocated from slabs and
+// released all at once by table_free. Buckets from bucket_init handed to
+// table_add are kept in external and freed one by one.
 typedef struct table {
-    bucket_t *buckets[TABLE_LEN];
+    bucket_t **buckets;
+    size_t count;
+    slot_t *slots;
+    size_t capacity;
+    slab_t *slabs;          // newest slab first
+    bucket_t **external;
+    size_t n_external;
+    size_t cap_external;
 } table_t;
 
-// Allocate a bucket and copy the IP into it
+// Parse a dotted quad IPv4 address into a packed key,
+// so 1.2.3.4 becomes 0x01020304 and the first octet is key >> 24
+//
+// This function will fail if:
+// - ip or key is NULL
+// - ip is not exactly four decimal octets of at most 255
+//
+// Return 0 on success, -1 on failure
+int ip_to_key(const char *ip, uint32_t *key);
+
+// Same as ip_to_key for the len bytes at ip, which do not need to be
+// null terminated, so a field can be parsed straight out of a log line
+int ip_to_key_n(const char *ip, size_t len, uint32_t *key);
+
+// Format a packed key back into a dotted quad string
+void key_to_ip(uint32_t key, char ip[IP_LEN]);
+
+// Allocate a bucket for the key of the IP
 //
 // Return the bucket on success, NULL on failure, or if ip is NULL
+// or not a valid IPv4 address
 bucket_t *bucket_init(const char ip[IP_LEN]);
 
-// Allocate a table and initialize the memory to 0
+// Allocate a bucket for an already packed key
 //
-// The memory must be initialized to 0, since referencing any
-// of the bucket pointers could otherwise result in some
-// non NULL garbage value
+// Return the bucket on success, NULL on failure
+bucket_t *bucket_init_key(uint32_t key);
+
+// Allocate an empty table with TABLE_INIT_CAP slots
+//
+// Every slot starts empty (idx of -1), the table grows
+// automatically in table_add once it passes its load factor
+//
+// Return the table on success, NULL on failure
 table_t *table_init();
 
 // Print the contents of a table
@@ -42,18 +163,37 @@ void table_print(const table_t *table);
 // Free a table and all corresponding buckets
 void table_free(table_t *table);
 
+// Remove and free every bucket of a table but keep its slot array and
+// newest slab, so refilling it does not have to grow it again
+void table_clear(table_t *table);
+
 // Add the given bucket to the table.
 // If there is already a bucket corresponding to the IP,
 // do not merge the two, as this function should only be called
 // if table_get first returns NULL.
 //
+// The table takes ownership of the bucket and frees it in table_free.
+// Doubles the slot array and rehashes when the load factor is exceeded.
+//
 // This function will fail if:
 // - table is NULL
 // - bucket is NULL or has no IP to hash
+// - growing the table fails
 //
 // Return 0 on success and -1 on failure
 int table_add(table_t *table, bucket_t *bucket);
 
+// Allocate a bucket for key from the table's slabs and add it, with
+// 0 requests. Like table_add this must only be called if the key is not
+// in the table yet.
+//
+// This function will fail if:
+// - table is NULL
+// - allocating a slab or growing the table fails
+//
+// Return the new bucket on success, NULL on failure
+bucket_t *table_add_key(table_t *table, uint32_t key);
+
 // Returns the hash table bucket corresponding to the given IP
 //
 // This function will fail if:
@@ -63,25 +203,103 @@ int table_add(table_t *table, bucket_t *bucket);
 // Returns NULL on failure, or if the requested bucket does not exist
 bucket_t *table_get(table_t *table, const char ip[IP_LEN]);
 
-// Return the hash table idx of the given ip
+// Returns the hash table bucket corresponding to the given packed key
+//
+// Returns NULL if table is NULL, or if the requested bucket does not exist
+bucket_t *table_get_key(table_t *table, uint32_t key);
+
+// Return the hash of the given ip
 //
 // The hash function should be deterministic, meaning that
-// every hash of a given IP should result in the same index.
+// every hash of a given IP should result in the same value.
+// The IP is packed with ip_to_key and hashed with hash_key.
 //
-// An example of a simple hash function would be:
-// add the int values of every character in the ip, and mod by table length
+// This function will fail if ip is NULL or not a valid IPv4 address,
+// return -1 on failure. Successful hashes are always non-negative.
+int hash_ip(const char ip[IP_LEN]);
+
+// Return the hash of a packed key
 //
-// When computing the hash, IPs can be less than IP_LENGTH.
-// Make sure that you do not hash any character values past the
-// end of the string (\0), or your hash function will not be deterministic.
+// The table masks the hash down to a slot index itself, so the
+// value is not bounded by the table capacity
+uint32_t hash_key(uint32_t key);
+
+// Continue the FNV-1a hash of the bytes before with len more bytes at
+// data. Table files store the hash of their records, starting from
+// TABLE_CHECKSUM_INIT.
+uint32_t table_checksum(uint32_t hash, const void *data, size_t len);
+
+// Start the header of an empty table file with the given key encoding
+void table_header_init(table_header_t *header, uint16_t key_encoding);
+
+// Return the size of a table file of count records of size bytes
+uint64_t table_file_size(size_t count, size_t size);
+
+// Write count records of size bytes, sorted by the uint32_t key or hash
+// each starts with, to out_file as a table file. header must have been
+// started with table_header_init, its index and checksum are filled in.
 //
-// This function will fail if ip is NULL, return -1 on failure
-int hash_ip(const char ip[IP_LEN]);
+// Return 0 on success, -1 on failure
+int table_write(const char out_file[MAX_PATH], table_header_t *header,
+                const void *records, size_t count, size_t size);
+
+// Read the records of size bytes with keys in [start, end) from a table
+// file of the given key encoding, and its header into header. Only the
+// blocks covering the range are read, each is checked against its fence
+// and the ends are trimmed with a binary search. end may be up to
+// KEY_SPACE.
+//
+// Return a newly allocated array of *count sorted records on success,
+// NULL on failure
+void *table_read_keys(const char in_file[MAX_PATH], uint16_t key_encoding,
+                      size_t size, uint64_t start, uint64_t end,
+                      table_header_t *header, size_t *count);
+
+// Read the record count of a table file without checking the records
+//
+// Return 0 on success, -1 on failure
+int table_file_count(const char in_file[MAX_PATH], size_t *count);
+
+// Sort records by key in place (LSD radix sort over the key bytes)
+void records_sort(record_t *records, size_t count);
+
+// Return the index of the first of count sorted records with a key >= key
+size_t records_lower_bound(const record_t *records, size_t count,
+                           uint64_t key);
+
+// Pick the key range [bounds[i], bounds[i + 1]) of each of n_reducers
+// reducers at the quantiles of a sample of keys, so every reducer gets
+// about the same number of records. The sample is sorted in place. With
+// an empty sample the key space is split evenly.
+void records_pick_bounds(record_t *sample, size_t n_sample, uint64_t bounds[],
+                         int n_reducers);
+
+// Streaming writer of a table file, for records that are produced in key
+// order so they never have to be held in memory at once
+typedef struct table_writer table_writer_t;
+
+// Create out_file and write a placeholder header
+//
+// Return a new writer on success, NULL on failure
+table_writer_t *table_writer_open(const char out_file[MAX_PATH]);
+
+// Append a record. Keys must be strictly increasing across calls.
+//
+// Return 0 on success, -1 on failure
+int table_writer_add(table_writer_t *writer, const record_t *record);
+
+// Fill in the header and close the file. The writer is freed either way.
+//
+// Return 0 on success, -1 on failure
+int table_writer_close(table_writer_t *writer);
+
+// Close and free a writer after a failure, leaving an invalid file behind
+void table_writer_abort(table_writer_t *writer);
 
 // Write the given table to a file. To write to a table file,
-// write every bucket in the table sequentially with the
-// `fwrite` function (in binary). Your solution must follow
-// this standard, otherwise it will fail the autograder.
+// write a table_header_t followed by a record_t for every bucket in the
+// table, sorted by key, and the fences of the records, with the `fwrite`
+// function (in binary).
 //
 // The file extension should be .tbl (representing a hash table)
 // You do not need to check this, but it is required to pass tests
@@ -98,20 +316,156 @@ int hash_ip(const char ip[IP_LEN]);
 int table_to_file(table_t *table, const char out_file[MAX_PATH]);
 
 // Read the requested file and parse it into a hash table.
-// The file must be a binary list of bucket_t structs
-// to read in sequence and add to a newly allocated table.
-// Your solution must follow this standard, otherwiswe it will
-// fail the autograder.
+// The file must be a table_header_t followed by the record_t structs
+// to read in sequence and add to a newly allocated table, which is
+// sized up front from the record count in the header.
 //
 // [See here on how to write/read structs to a
 // file](https://www.geeksforgeeks.org/c/read-write-structure-from-to-a-file-in-c/)
 //
 // This function will fail if:
-// - table is NULL
 // - in_file is NULL
 // - file I/O fails
+// - the header is not a valid version TABLE_VERSION header, the file
+//   size does not match the record count or the checksum does not match
 //
 // Return a newly allocated table object on success, NULL on failure
 table_t *table_from_file(const char in_file[MAX_PATH]);
 
+// Read only the records with keys in [start, end) from a table file with
+// table_read_keys. The header index narrows the range down to octets and
+// their fences down to the blocks holding it, which are read with a
+// single seek. end may be up to KEY_SPACE.
+//
+// This function will fail if:
+// - in_file or count is NULL
+// - file I/O fails, the header is corrupt or the checksum does not match
+//
+// Return a newly allocated array of *count sorted records on success,
+// NULL on failure
+record_t *table_read_range(const char in_file[MAX_PATH], uint64_t start,
+                           uint64_t end, size_t *count);
+
+// Read up to max records spread evenly over a table file. Since records
+// are sorted, the sample keys approximate the quantiles of the file.
+//
+// Return a newly allocated array of *count records on success,
+// NULL on failure
+record_t *table_sample(const char in_file[MAX_PATH], size_t max,
+                       size_t *count);
+
+// Read-only view of a table file mapped into memory. records points
+// straight into the mapping, so iterating a table allocates nothing and
+// only touches the pages of the records actually read.
+typedef struct table_view {
+    const table_header_t *header;
+    const record_t *records;    // count records sorted by key
+    const table_fence_t *fences;    // TABLE_FENCES(count) fences
+    size_t count;
+    size_t map_len;             // length of the mapping, for munmap
+} table_view_t;
+
+// Map in_file and check its header and size. The checksum is not checked
+// so that opening a view stays cheap, see table_view_verify.
+//
+// Return a new view on success, NULL on failure
+table_view_t *table_view_open(const char in_file[MAX_PATH]);
+
+// Find the records of a view with keys in [start, end), end may be up to
+// KEY_SPACE
+//
+// Return a pointer to the first of *count records inside the view
+const record_t *table_view_range(const table_view_t *view, uint64_t start,
+                                 uint64_t end, size_t *count);
+
+// Check the checksum of every record of a view
+//
+// Return 0 if it matches, -1 otherwise
+int table_view_verify(const table_view_t *view, const char in_file[MAX_PATH]);
+
+// Check the checksums of the blocks covering keys [start, end) of a view,
+// which is all a reader of that range touches
+//
+// Return 0 if they match, -1 otherwise
+int table_view_verify_range(const table_view_t *view, uint64_t start,
+                            uint64_t end, const char in_file[MAX_PATH]);
+
+// Unmap and free a view
+void table_view_close(table_view_t *view);
+
+// Sequential reader of the records with keys in [start, end) of a table
+// file, in key order. Only a buffer of the file is held in memory, so
+// many runs can be merged at once.
+typedef struct table_run table_run_t;
+
+// Open in_file and seek to the first block of start. The run reads the
+// blocks covering [start, end) and checks each against its fence, so
+// table_run_next fails on a corrupt block.
+//
+// Return a new run on success, NULL on failure
+table_run_t *table_run_open(const char in_file[MAX_PATH], uint64_t start,
+                            uint64_t end);
+
+// Read a headerless stream of sorted records from fd, such as a pipe
+// from a mapper, until EOF. Only keys in [start, end) are returned.
+//
+// Return a new run that owns fd on success, NULL on failure
+table_run_t *table_run_fdopen(int fd, uint64_t start, uint64_t end);
+
+// Parse a single non-negative file descriptor, rejecting any trailing
+// characters
+//
+// Return 0 on success, -1 on failure
+int parse_fd(const char *arg, int *fd);
+
+// Parse a comma separated list of file descriptors into a newly
+// allocated array
+//
+// Return the number of descriptors on success, -1 on failure
+int parse_fd_list(const char *list, int **fds);
+
+// Parse a plain positive count that fits in an int, without suffixes,
+// rejecting any trailing characters
+//
+// Return 0 on success, -1 on failure
+int parse_count(const char *arg, size_t *count);
+
+// Write count records to fd as a headerless stream for table_run_fdopen
+//
+// Return 0 on success, -1 on failure
+int records_write_fd(int fd, const record_t *records, size_t count);
+
+// Print every record as an "ip - requests" line to fp. Lines are
+// formatted by hand into a large buffer and written in blocks, which is
+// much cheaper than a printf per line for millions of records.
+//
+// Return 0 on success, -1 on failure
+int records_print(FILE *fp, const record_t *records, size_t count);
+
+// Read the next record of the run into record
+//
+// Return 1 if a record was read, 0 at the end of the run, -1 on failure
+int table_run_next(table_run_t *run, record_t *record);
+
+// Close and free a run
+void table_run_close(table_run_t *run);
+
+// Merge the records in [start, end) of n_files sorted table files into
+// out_file with a k-way merge over a binary heap, summing equal keys as
+// they stream past. Only one run buffer per input is held in memory.
+// If n_read is not NULL it is set to the number of records merged.
+//
+// Return 0 on success, -1 on failure
+int table_merge(const char *in_files[], size_t n_files, uint64_t start,
+                uint64_t end, const char out_file[MAX_PATH], size_t *n_read);
+
+// Same as table_merge over runs that are already open. Records are
+// consumed as they arrive, so runs fed by pipes are merged while their
+// writers are still producing. Every run is closed, and the merge fails
+// if any run fails a checksum.
+//
+// Return 0 on success, -1 on failure
+int table_merge_runs(table_run_t *runs[], size_t n_runs,
+                     const char out_file[MAX_PATH], size_t *n_read);
+
 #endif    // TABLE_H
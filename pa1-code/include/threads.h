@@ -0,0 +1,26 @@
+#ifndef THREADS_H
+#define THREADS_H
+
+#include "./table.h"
+
+#define SAMPLES_PER_RUN 1024    // keys sampled from every mapper run
+
+// Run a whole job inside this process instead of forking ./map and
+// ./reduce, selected with `mapreduce --threads`.
+//
+// n_mappers threads pull the task arguments (`file` or
+// `file:offset:length`, split in place) from a shared cursor in order,
+// so tasks should be sorted largest first. Every mapper counts into its
+// own table and turns it into a sorted run in memory. The key space is
+// then split at the quantiles of a sample of the runs, and n_reducers
+// threads each merge their key range of every run. The reducer outputs
+// are disjoint and sorted, so they are printed in order, in the same
+// format as the multi process mode.
+//
+// With verbose, per mapper and per reducer counts are printed to stderr.
+//
+// Return 0 on success, -1 on failure
+int run_threads(char *tasks[], int n_tasks, int n_mappers, int n_reducers,
+                int verbose);
+
+#endif    // THREADS_H
@@ -0,0 +1,95 @@
+#ifndef TOPK_H
+#define TOPK_H
+
+#include <stdint.h>
+#include <stdio.h>
+
+#include "./table.h"
+
+#define TOPK_FACTOR 16       // counters kept per requested key
+#define TOPK_MIN_CAP 1024    // never keep fewer counters than this
+
+// Definition of a Space-Saving counter, both the entry of a summary and
+// the record of a summary file
+//
+// count never underestimates the requests of key and overestimates them
+// by at most error, so the true count is in [count - error, count].
+typedef struct topk_entry {
+    uint32_t key;      // IPv4 address packed by ip_to_key
+    int count;
+    int error;
+} topk_entry_t;
+
+// Definition of a Space-Saving summary of at most capacity counters
+//
+// The counters form a binary min-heap on count, so the counter to evict
+// is always entries[0]. slots maps a key to the heap position of its
+// counter with linear probing.
+typedef struct topk {
+    topk_entry_t *entries;
+    size_t count;
+    size_t capacity;
+    struct topk_slot *slots;
+    size_t n_slots;    // power of two, at least twice capacity
+} topk_t;
+
+// Allocate an empty summary that keeps at most capacity counters, so its
+// memory does not grow with the number of distinct keys
+//
+// Return the summary on success, NULL on failure
+topk_t *topk_init(size_t capacity);
+
+// Free a summary
+void topk_free(topk_t *topk);
+
+// Count requests more requests of key. A key without a counter in a
+// full summary takes over the counter with the smallest count, keeping
+// that count as its error.
+//
+// Return 0 on success, -1 on failure
+int topk_add(topk_t *topk, uint32_t key, int requests);
+
+// Return the bound on the count of any key without a counter, the
+// smallest count once the summary is full and 0 before
+uint32_t topk_floor(const topk_t *topk);
+
+// Write count entries sorted by key to out_file as a table file with key
+// encoding TABLE_KEY_TOPK and floor in its header
+//
+// Return 0 on success, -1 on failure
+int topk_write(const char out_file[MAX_PATH], const topk_entry_t *entries,
+               size_t count, uint32_t floor);
+
+// Write the counters of a summary to out_file with topk_write. The
+// counters are sorted in place, so the summary must not be added to
+// afterwards.
+//
+// Return 0 on success, -1 on failure
+int topk_to_file(topk_t *topk, const char out_file[MAX_PATH]);
+
+// Read the entries of a summary file whose key is in [start, end) into
+// a new array, and the floor of the file into floor. The checksums of
+// the blocks read are verified.
+//
+// Return the entries on success with their number in count, NULL on failure
+topk_entry_t *topk_read_range(const char in_file[MAX_PATH], uint64_t start,
+                              uint64_t end, size_t *count, uint32_t *floor);
+
+// Merge n summaries of disjoint inputs, each as entries sorted by key
+// with its floor. A key missing from a summary is charged that summary's
+// floor both as count and as error. The capacity largest counts are kept
+// and the rest only raise the floor of the result.
+//
+// Return the merged entries sorted by key on success with their number in
+// count and the bound on every other key in floor, NULL on failure
+topk_entry_t *topk_merge(topk_entry_t *entries[], const size_t counts[],
+                         const uint32_t floors[], size_t n, size_t capacity,
+                         size_t *count, uint32_t *floor);
+
+// Sort entries by count, largest first, and print the first n as
+// "ip - count error=<error>" lines
+//
+// Return 0 on success, -1 on failure
+int topk_print(FILE *fp, topk_entry_t *entries, size_t count, size_t n);
+
+#endif    // TOPK_H
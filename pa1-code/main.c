@@ -1,36 +1,732 @@
 #include <dirent.h>
 #include <errno.h>
+#include <fcntl.h>
+#include <getopt.h>
+#include <signal.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <sys/resource.h>
+#include <sys/stat.h>
 #include <sys/wait.h>
 #include <unistd.h>
 
+#include "./include/group.h"
+#include "./include/map.h"
+#include "./include/stats.h"
 #include "./include/table.h"
+#include "./include/threads.h"
+#include "./include/topk.h"
 
 #define MAX_FILES 1024
 #define MAX_PATH 1024
 
-struct record {
-  char ip[IP_LEN];
-  int requests;
+#define MIN_CHUNK (64 * 1024)    // never cut a file into chunks smaller than this
+#define QUEUE_SPLIT 4            // tasks per mapper to aim for with --dynamic
+#define SAMPLES_PER_TABLE 1024   // keys sampled from every intermediate table
+#define N_PHASES 4               // scan, map, reduce and output, see write_report
+#define FD_SPARE 16              // fds to leave free for files opened beside the --pipes grid
+
+// A piece of work for a mapper, a whole file or a line aligned chunk of one
+struct map_task {
+  char arg[TASK_LEN];    // `file` or `file:offset:length` as passed to ./map
+  off_t bytes;
+  int mapper;
 };
 
-int cmp_record(const void *a, const void *b) {
-  const struct record *ra = a;
-  const struct record *rb = b;
-  return strcmp(ra->ip, rb->ip);
+// Return the offset just past the first newline at or after pos,
+// or size if the rest of the file has no newline
+off_t next_line(int fd, off_t pos, off_t size) {
+  char buf[4096];
+  while (pos < size) {
+    ssize_t n = pread(fd, buf, sizeof(buf), pos);
+    if (n <= 0) {
+      return size;
+    }
+    char *nl = memchr(buf, '\n', n);
+    if (nl) {
+      return pos + (nl - buf) + 1;
+    }
+    pos += n;
+  }
+  return size;
+}
+
+// Append the tasks covering path to tasks. Files larger than chunk are cut
+// into pieces of about chunk bytes, each moved forward to start on a line.
+//
+// Return 0 on success, -1 on failure
+int add_tasks(struct map_task **tasks, int *n_tasks, int *cap,
+              const char *path, off_t size, off_t chunk) {
+  int pieces = size > chunk ? (int)((size + chunk - 1) / chunk) : 1;
+  if (*n_tasks + pieces > *cap) {
+    *cap = (*n_tasks + pieces) * 2;
+    struct map_task *grown = realloc(*tasks, *cap * sizeof(struct map_task));
+    if (!grown) {
+      fprintf(stderr, "malloc failed\n");
+      return -1;
+    }
+    *tasks = grown;
+  }
+
+  if (pieces == 1) {
+    struct map_task *task = &(*tasks)[(*n_tasks)++];
+    snprintf(task->arg, sizeof(task->arg), "%s", path);
+    task->bytes = size;
+    return 0;
+  }
+
+  int fd = open(path, O_RDONLY);
+  if (fd < 0) {
+    perror("open");
+    return -1;
+  }
+  off_t start = 0;
+  for (int k = 1; k <= pieces && start < size; k++) {
+    off_t end = k == pieces ? size : next_line(fd, k * chunk - 1, size);
+    if (end <= start) {
+      continue;
+    }
+    struct map_task *task = &(*tasks)[(*n_tasks)++];
+    snprintf(task->arg, sizeof(task->arg), "%s:%lld:%lld", path,
+             (long long)start, (long long)(end - start));
+    task->bytes = end - start;
+    start = end;
+  }
+  close(fd);
+  return 0;
+}
+
+// Largest task first, ties broken by name so the assignment is deterministic
+int cmp_task(const void *a, const void *b) {
+  const struct map_task *ta = a;
+  const struct map_task *tb = b;
+  if (ta->bytes != tb->bytes)
+    return ta->bytes < tb->bytes ? 1 : -1;
+  return strcmp(ta->arg, tb->arg);
+}
+
+// Assign every task to a mapper by size rather than by count. Tasks are
+// taken largest first and each goes to the mapper with the fewest bytes so
+// far (LPT scheduling), so no mapper ends up with several large files while
+// another only has small ones. Fills in task->mapper, and the bytes and
+// task count of every mapper in load and counts.
+void balance_tasks(struct map_task *tasks, int n_tasks, off_t load[],
+                   int counts[], int n_mappers) {
+  qsort(tasks, n_tasks, sizeof(struct map_task), cmp_task);
+  for (int i = 0; i < n_mappers; i++) {
+    load[i] = 0;
+    counts[i] = 0;
+  }
+  for (int t = 0; t < n_tasks; t++) {
+    int least = 0;
+    for (int i = 1; i < n_mappers; i++) {
+      if (load[i] < load[least])
+        least = i;
+    }
+    tasks[t].mapper = least;
+    load[least] += tasks[t].bytes;
+    counts[least]++;
+  }
+}
+
+// Pick the key range [bounds[i], bounds[i + 1]) of every reducer so that
+// each gets about the same number of intermediate records. Keys are
+// sampled evenly from every (sorted) intermediate table and the reducer
+// boundaries are the quantiles of the sample, so popular networks are
+// spread over several reducers instead of landing on one first octet.
+// Only the tables of the n_tables mappers listed in mappers are sampled.
+// Falls back to an even split of the address space if nothing was sampled.
+//
+// Return 0 on success, -1 on failure
+int pick_bounds(const int mappers[], int n_tables, uint64_t bounds[],
+                int n_reducers) {
+  record_t *sample = malloc(sizeof(record_t) * SAMPLES_PER_TABLE * n_tables);
+  if (!sample) {
+    fprintf(stderr, "malloc failed\n");
+    return -1;
+  }
+  size_t n_sample = 0;
+  for (int i = 0; i < n_tables; i++) {
+    char path[MAX_PATH];
+    snprintf(path, sizeof(path), "./intermediate/%d.tbl", mappers[i]);
+    size_t count;
+    record_t *records = table_sample(path, SAMPLES_PER_TABLE, &count);
+    if (!records) {
+      free(sample);
+      return -1;
+    }
+    memcpy(sample + n_sample, records, count * sizeof(record_t));
+    n_sample += count;
+    free(records);
+  }
+  records_pick_bounds(sample, n_sample, bounds, n_reducers);
+  free(sample);
+  return 0;
+}
+
+// Format a reducer bound as an argument for ./reduce
+void format_bound(uint64_t bound, char *buf, size_t len) {
+  if (bound >= KEY_SPACE) {
+    snprintf(buf, len, "256");
+  } else {
+    char ip[IP_LEN];
+    key_to_ip((uint32_t)bound, ip);
+    snprintf(buf, len, "%s", ip);
+  }
+}
+
+// Close every end of the n_mappers x n_reducers grid of shuffle pipes
+// except the write ends of row mapper and the read ends of column
+// reducer, either may be -1 to keep none
+void keep_shuffle(int (*shuffle)[2], int n_mappers, int n_reducers,
+                  int mapper, int reducer) {
+  for (int m = 0; m < n_mappers; m++) {
+    for (int r = 0; r < n_reducers; r++) {
+      if (m != mapper)
+        close(shuffle[m * n_reducers + r][1]);
+      if (r != reducer)
+        close(shuffle[m * n_reducers + r][0]);
+    }
+  }
+}
+
+// Format the write ends of row mapper, or the read ends of column reducer
+// if mapper is -1, of the shuffle grid as a comma separated list
+//
+// Return a newly allocated string on success, NULL on failure
+char *shuffle_list(int (*shuffle)[2], int n_mappers, int n_reducers,
+                   int mapper, int reducer) {
+  int n = mapper >= 0 ? n_reducers : n_mappers;
+  char *list = malloc(n * 12 + 1);
+  if (!list)
+    return NULL;
+  int len = 0;
+  for (int i = 0; i < n; i++) {
+    int fd = mapper >= 0 ? shuffle[mapper * n_reducers + i][1]
+                         : shuffle[i * n_reducers + reducer][0];
+    len += sprintf(list + len, i ? ",%d" : "%d", fd);
+  }
+  return list;
+}
+
+// Return the number of file descriptors open in this process, counted in
+// /proc/self/fd, or 3 for the standard streams if it cannot be read
+int count_open_fds(void) {
+  DIR *dir = opendir("/proc/self/fd");
+  if (!dir)
+    return 3;
+  int n = 0;
+  struct dirent *entry;
+  while ((entry = readdir(dir)) != NULL) {
+    if (entry->d_name[0] != '.')
+      n++;
+  }
+  closedir(dir);
+  return n - 1;    // the fd of dir itself
+}
+
+// Make room for n more file descriptors on top of the ones already open
+// and FD_SPARE, raising the soft RLIMIT_NOFILE up to the hard limit if
+// needed. Children inherit the raised limit.
+//
+// Return 0 if they fit, -1 otherwise with the limit in *limit
+int reserve_fds(long long n, long long *limit) {
+  struct rlimit rl;
+  if (getrlimit(RLIMIT_NOFILE, &rl) != 0) {
+    perror("getrlimit");
+    *limit = 0;
+    return -1;
+  }
+  long long needed = n + count_open_fds() + FD_SPARE;
+  if (rl.rlim_cur == RLIM_INFINITY || (long long)rl.rlim_cur >= needed)
+    return 0;
+  if (rl.rlim_max == RLIM_INFINITY || (long long)rl.rlim_max >= needed) {
+    rl.rlim_cur = (rlim_t)needed;
+    if (setrlimit(RLIMIT_NOFILE, &rl) == 0)
+      return 0;
+  }
+  *limit = (long long)rl.rlim_cur;
+  return -1;
+}
+
+// How the reducers of a job are started, see spawn_reducer
+struct reduce_plan {
+  const uint64_t *bounds;    // reducer i owns [bounds[i], bounds[i + 1])
+  int (*shuffle)[2];         // --pipes grid of mapper to reducer pipes
+  int (*manifest)[2];        // --overlap pipes naming finished tables
+  int n_mappers;
+  int n_reducers;
+  const int *queue;          // --dynamic work queue, -1 once closed
+  const char *stats_file;    // --stats report
+  int group;                 // --group, intermediate tables are group tables
+  int aggregates;            // --aggregates, group tables carry every aggregate
+  const char *topk;          // --top-k, counters per summary, or NULL
+};
+
+// Fork and exec reducer i for the keys in [bounds[i], bounds[i + 1]).
+// With shuffle it merges column i of the shuffle pipes as the mappers
+// fill them. With manifest it reads the intermediate tables named on
+// manifest[i] as the mappers finish, otherwise every table in
+// ./intermediate, as group tables with group, with every aggregate with
+// aggregates, or as summaries of topk counters with topk. With stats_file the
+// reducer reports its counters to stats_file.reduce<i>.
+//
+// Return the pid of the reducer on success, -1 on failure
+pid_t spawn_reducer(int i, const struct reduce_plan *plan) {
+  const uint64_t *bounds = plan->bounds;
+  int (*shuffle)[2] = plan->shuffle;
+  int (*manifest)[2] = plan->manifest;
+  int n_mappers = plan->n_mappers;
+  int n_reducers = plan->n_reducers;
+  const int *queue = plan->queue;
+  const char *stats_file = plan->stats_file;
+
+  pid_t pid = fork();
+  if (pid < 0) {
+    perror("fork");
+    return -1;
+  }
+  if (pid > 0)
+    return pid;
+
+  // a reducer holding the queue open would keep mappers from seeing EOF
+  if (queue[1] >= 0) {
+    close(queue[0]);
+    close(queue[1]);
+  }
+
+  char outfile[MAX_PATH];
+  snprintf(outfile, sizeof(outfile), "./out/%d.tbl", i);
+
+  char start_str[IP_LEN], end_str[IP_LEN];
+  format_bound(bounds[i], start_str, sizeof(start_str));
+  format_bound(bounds[i + 1], end_str, sizeof(end_str));
+
+  char *args[12];
+  int n_args = 0;
+  args[n_args++] = "./reduce";
+
+  char fd_str[16];
+  if (shuffle) {
+    keep_shuffle(shuffle, n_mappers, n_reducers, -1, i);
+    args[n_args++] = "--pipes";
+    args[n_args++] = shuffle_list(shuffle, n_mappers, n_reducers, -1, i);
+    if (!args[n_args - 1])
+      exit(1);
+  } else if (manifest) {
+    for (int r = 0; r < n_reducers; r++) {
+      close(manifest[r][1]);
+      if (r != i)
+        close(manifest[r][0]);
+    }
+    snprintf(fd_str, sizeof(fd_str), "%d", manifest[i][0]);
+    args[n_args++] = "--manifest";
+    args[n_args++] = fd_str;
+  } else if (plan->topk) {
+    args[n_args++] = "--top-k";
+    args[n_args++] = (char *)plan->topk;
+  } else {
+    args[n_args++] = plan->group ? "--group" : "--merge";
+    if (plan->aggregates)
+      args[n_args++] = "--aggregates";
+  }
+
+  char stats_path[MAX_PATH];
+  if (stats_file) {
+    snprintf(stats_path, sizeof(stats_path), "%s.reduce%d", stats_file, i);
+    args[n_args++] = "--stats";
+    args[n_args++] = stats_path;
+  }
+
+  if (!shuffle && !manifest)
+    args[n_args++] = "./intermediate";
+  args[n_args++] = outfile;
+  args[n_args++] = start_str;
+  args[n_args++] = end_str;
+  args[n_args] = NULL;
+
+  execv("./reduce", args);
+  perror("execv failed");
+  exit(1);
+}
+
+// Kill and reap every child in pids that is still running, so a failed
+// job leaves no processes behind. Children already reaped are -1.
+void stop_children(pid_t pids[], int n) {
+  for (int i = 0; i < n; i++) {
+    if (pids[i] > 0)
+      kill(pids[i], SIGKILL);
+  }
+  for (int i = 0; i < n; i++) {
+    if (pids[i] > 0)
+      waitpid(pids[i], NULL, 0);
+    pids[i] = -1;
+  }
+}
+
+// Write the --stats report of a job to path as JSON: the wall time of
+// every phase, the job total and the counters every mapper and reducer
+// left in path.map<i> and path.reduce<i>, which are removed. With
+// --pipes or --overlap the map and reduce phases overlap. The total adds
+// up the lines and bytes read of the mappers, the bytes written by
+// every process and the keys of the reducers.
+//
+// Return 0 on success, -1 on failure
+int write_report(const char *path, stats_t *total,
+                 const double phase_sec[N_PHASES], int n_mappers,
+                 int n_reducers) {
+  static const char *phase_names[N_PHASES] = {"scan", "map", "reduce",
+                                              "output"};
+  stats_t *workers = calloc(n_mappers + n_reducers, sizeof(stats_t));
+  if (!workers) {
+    fprintf(stderr, "malloc failed\n");
+    return -1;
+  }
+  for (int w = 0; w < n_mappers + n_reducers; w++) {
+    char worker_path[MAX_PATH];
+    if (w < n_mappers)
+      snprintf(worker_path, sizeof(worker_path), "%s.map%d", path, w);
+    else
+      snprintf(worker_path, sizeof(worker_path), "%s.reduce%d", path,
+               w - n_mappers);
+    if (stats_read(worker_path, &workers[w]) != 0) {
+      free(workers);
+      return -1;
+    }
+    unlink(worker_path);
+
+    if (w < n_mappers) {
+      total->lines += workers[w].lines;
+      total->rejected += workers[w].rejected;
+      total->bytes_read += workers[w].bytes_read;
+    } else {
+      total->keys += workers[w].keys;
+    }
+    total->bytes_written += workers[w].bytes_written;
+  }
+
+  FILE *fp = fopen(path, "w");
+  if (!fp) {
+    perror("fopen");
+    free(workers);
+    return -1;
+  }
+  fprintf(fp, "{\n  \"mappers\": %d,\n  \"reducers\": %d,\n", n_mappers,
+          n_reducers);
+  fprintf(fp, "  \"phases\": {");
+  for (int p = 0; p < N_PHASES; p++)
+    fprintf(fp, "%s\"%s_sec\": %.6f", p ? ", " : "", phase_names[p],
+            phase_sec[p]);
+  fprintf(fp, "},\n  \"total\": ");
+  stats_print(fp, total);
+  for (int w = 0; w < n_mappers + n_reducers; w++) {
+    if (w == 0)
+      fprintf(fp, ",\n  \"map\": [\n");
+    else if (w == n_mappers)
+      fprintf(fp, "\n  ],\n  \"reduce\": [\n");
+    else
+      fprintf(fp, ",\n");
+    fprintf(fp, "    ");
+    stats_print(fp, &workers[w]);
+  }
+  fprintf(fp, "\n  ]\n}\n");
+  free(workers);
+  if (fclose(fp) != 0) {
+    perror("fclose");
+    return -1;
+  }
+  return 0;
+}
+
+// Write the window tables of records sorted by key, with every aggregate
+// with aggregates, to ./out/windows, dropping the tables of an earlier
+// run first so only windows of this job are left
+//
+// Return the number of tables written on success, -1 on failure
+int write_windows(void *records, size_t count, int aggregates) {
+  if (mkdir("./out/windows", 0777) < 0 && errno != EEXIST) {
+    perror("mkdir out/windows");
+    return -1;
+  }
+  DIR *dir = opendir("./out/windows");
+  if (dir) {
+    struct dirent *entry;
+    while ((entry = readdir(dir)) != NULL) {
+      if (strstr(entry->d_name, ".tbl")) {
+        char path[MAX_PATH];
+        snprintf(path, sizeof(path), "./out/windows/%s", entry->d_name);
+        unlink(path);
+      }
+    }
+    closedir(dir);
+  }
+  return group_write_windows(records, count, aggregates, "./out/windows");
+}
+
+// Print the group tables of every reducer sorted by key. Reducers own
+// ranges of key hashes rather than of keys, so their outputs are
+// gathered and sorted together. With verbose the keys and records of
+// every reducer are printed to stderr, with aggregates every aggregate
+// of a key follows its count. With windows the time,ip keys are also
+// written as one table per time bucket to ./out/windows.
+//
+// Return 0 on success, -1 on failure
+int print_groups(int n_reducers, int verbose, int aggregates, int windows) {
+  size_t size = group_record_size(aggregates);
+  char *all = NULL;
+  size_t n = 0;
+  for (int r = 0; r < n_reducers; r++) {
+    char path[MAX_PATH];
+    snprintf(path, sizeof(path), "./out/%d.tbl", r);
+    size_t count;
+    void *records =
+        group_read_range(path, 0, KEY_SPACE, aggregates, &count);
+    if (!records) {
+      fprintf(stderr, "Failed to load table from %s\n", path);
+      free(all);
+      return -1;
+    }
+    if (verbose) {
+      long long requests = 0;
+      for (size_t k = 0; k < count; k++)
+        requests += group_record_at(records, k, aggregates)->requests;
+      fprintf(stderr, "mapreduce: reducer %d: %zu keys, %lld records\n", r,
+              count, requests);
+    }
+    char *grown = realloc(all, (n + count + 1) * size);
+    if (!grown) {
+      fprintf(stderr, "malloc failed\n");
+      free(records);
+      free(all);
+      return -1;
+    }
+    all = grown;
+    memcpy(all + n * size, records, count * size);
+    n += count;
+    free(records);
+  }
+  int ret = group_print(stdout, all, n, aggregates);
+  if (ret == 0 && windows) {
+    int n_windows = write_windows(all, n, aggregates);
+    if (n_windows < 0)
+      ret = -1;
+    else if (verbose)
+      fprintf(stderr, "mapreduce: wrote %d window tables to ./out/windows\n",
+              n_windows);
+  }
+  free(all);
+  return ret;
+}
+
+// Print the n IPs with the most requests from the summaries of every
+// reducer. Reducers own disjoint key ranges, so their counters are only
+// gathered, not merged again. With verbose the counters of every
+// reducer and the bound on the IPs left out are printed to stderr.
+//
+// Return 0 on success, -1 on failure
+int print_topk(int n_reducers, size_t n, int verbose) {
+  topk_entry_t *all = NULL;
+  size_t total = 0;
+  uint32_t floor = 0;
+  for (int r = 0; r < n_reducers; r++) {
+    char path[MAX_PATH];
+    snprintf(path, sizeof(path), "./out/%d.tbl", r);
+    size_t count;
+    uint32_t reducer_floor;
+    topk_entry_t *entries =
+        topk_read_range(path, 0, KEY_SPACE, &count, &reducer_floor);
+    if (!entries) {
+      fprintf(stderr, "Failed to load summary from %s\n", path);
+      free(all);
+      return -1;
+    }
+    if (verbose)
+      fprintf(stderr, "mapreduce: reducer %d: %zu counters, floor %u\n", r,
+              count, reducer_floor);
+    if (reducer_floor > floor)
+      floor = reducer_floor;
+    topk_entry_t *grown = realloc(all, (total + count + 1) * sizeof(*all));
+    if (!grown) {
+      fprintf(stderr, "malloc failed\n");
+      free(entries);
+      free(all);
+      return -1;
+    }
+    all = grown;
+    memcpy(all + total, entries, count * sizeof(*all));
+    total += count;
+    free(entries);
+  }
+  int ret = topk_print(stdout, all, total, n);
+  // topk_print left the counters sorted, largest first
+  if (ret == 0 && verbose) {
+    if (n < total && (uint32_t)all[n].count > floor)
+      floor = (uint32_t)all[n].count;
+    fprintf(stderr, "mapreduce: every IP left out made at most %u requests\n",
+            floor);
+  }
+  free(all);
+  return ret;
+}
+
+// Parse a window width, minute, hour, day or a number of seconds
+//
+// Return 0 on success, -1 on failure
+int parse_window(const char *arg, long *sec) {
+  if (strcmp(arg, "minute") == 0) {
+    *sec = 60;
+  } else if (strcmp(arg, "hour") == 0) {
+    *sec = 3600;
+  } else if (strcmp(arg, "day") == 0) {
+    *sec = 86400;
+  } else {
+    char *end;
+    *sec = strtol(arg, &end, 10);
+    if (end == arg || *end != '\0' || *sec <= 0)
+      return -1;
+  }
+  return 0;
 }
 
 int main(int argc, char *argv[]) {
-  if (argc < 4) {
+  static const struct option options[] = {
+      {"verbose", no_argument, NULL, 'v'},
+      {"dynamic", no_argument, NULL, 'd'},
+      {"map-memory", required_argument, NULL, 'm'},
+      {"threads", no_argument, NULL, 't'},
+      {"pipes", no_argument, NULL, 'p'},
+      {"overlap", no_argument, NULL, 'o'},
+      {"stats", required_argument, NULL, 's'},
+      {"group", required_argument, NULL, 'g'},
+      {"aggregates", no_argument, NULL, 'a'},
+      {"window", required_argument, NULL, 'w'},
+      {"top-k", required_argument, NULL, 'k'},
+      {NULL, 0, NULL, 0},
+  };
+  int verbose = 0;
+  int dynamic = 0;
+  int threads = 0;
+  int pipes = 0;
+  int overlap = 0;
+  char *map_memory = NULL;
+  const char *stats_file = NULL;
+  char *group_by = NULL;
+  int aggregates = 0;
+  char *window = NULL;
+  size_t top_k = 0;
+  int opt;
+  // "+" stops at the first positional argument, so negative
+  // mapper/reducer counts are not mistaken for options
+  while ((opt = getopt_long(argc, argv, "+vdm:tpos:g:aw:k:", options, NULL)) != -1) {
+    if (opt == 'v') {
+      verbose = 1;
+    } else if (opt == 'd') {
+      dynamic = 1;
+    } else if (opt == 'm') {
+      map_memory = optarg;
+    } else if (opt == 't') {
+      threads = 1;
+    } else if (opt == 'p') {
+      pipes = 1;
+    } else if (opt == 'o') {
+      overlap = 1;
+    } else if (opt == 's') {
+      stats_file = optarg;
+    } else if (opt == 'g') {
+      group_by = optarg;
+    } else if (opt == 'a') {
+      aggregates = 1;
+    } else if (opt == 'w') {
+      window = optarg;
+    } else if (opt == 'k' && parse_count(optarg, &top_k) == 0) {
+      // top_k is set
+    } else {
+      fprintf(stderr, "Usage: mapreduce <directory> <n mappers> <n reducers>\n");
+      return 1;
+    }
+  }
+
+  if (argc - optind < 3) {
     fprintf(stderr, "Usage: mapreduce <directory> <n mappers> <n reducers>\n");
     return 1;
   }
 
-  char *dir_name = argv[1];
-  int n_mappers = atoi(argv[2]);
-  int n_reducers = atoi(argv[3]);
+  if (threads && map_memory) {
+    fprintf(stderr, "mapreduce: --map-memory needs mapper processes, "
+                    "it cannot be used with --threads\n");
+    return 1;
+  }
+  if (pipes && (threads || map_memory)) {
+    fprintf(stderr, "mapreduce: --pipes cannot be used with --threads "
+                    "or --map-memory\n");
+    return 1;
+  }
+  if (overlap && (threads || pipes)) {
+    fprintf(stderr, "mapreduce: --overlap cannot be used with --threads "
+                    "or --pipes\n");
+    return 1;
+  }
+  // windows are group tables keyed by time bucket and IP
+  char window_spec[64];
+  if (window) {
+    long window_sec;
+    if (group_by || parse_window(window, &window_sec) != 0) {
+      fprintf(stderr, "mapreduce: invalid window %s, expected minute, hour, "
+                      "day or seconds, without --group\n", window);
+      return 1;
+    }
+    snprintf(window_spec, sizeof(window_spec), "time:%ld,ip", window_sec);
+    group_by = window_spec;
+  }
+  // aggregates live in group tables, by default keyed by IP alone
+  if (aggregates && !group_by)
+    group_by = "ip";
+  group_spec_t group_spec;
+  if (group_by && group_parse(group_by, aggregates, &group_spec) != 0) {
+    fprintf(stderr, "mapreduce: invalid group by %s, expected a comma "
+                    "separated list of ip, route, method, status and "
+                    "time[:seconds]\n", group_by);
+    return 1;
+  }
+  if (group_by && (threads || pipes || overlap || map_memory)) {
+    fprintf(stderr, "mapreduce: --group, --aggregates and --window cannot be "
+                    "used with --threads, --pipes, --overlap or --map-memory\n");
+    return 1;
+  }
+  if (top_k && (group_by || threads || pipes || overlap || map_memory)) {
+    fprintf(stderr, "mapreduce: --top-k cannot be used with --group, "
+                    "--aggregates, --window, --threads, --pipes, --overlap "
+                    "or --map-memory\n");
+    return 1;
+  }
+  // mappers and reducers keep TOPK_FACTOR counters per IP asked for, so
+  // the first screen of IPs is right even when counts are close
+  if (top_k > INT32_MAX / TOPK_FACTOR) {
+    fprintf(stderr, "mapreduce: --top-k %zu is too large, at most %d IPs "
+                    "can be asked for\n", top_k, INT32_MAX / TOPK_FACTOR);
+    return 1;
+  }
+  char topk_cap[24];
+  if (top_k) {
+    size_t cap = top_k * TOPK_FACTOR;
+    snprintf(topk_cap, sizeof(topk_cap), "%zu",
+             cap < TOPK_MIN_CAP ? (size_t)TOPK_MIN_CAP : cap);
+  }
+  if (threads && stats_file) {
+    fprintf(stderr, "mapreduce: --stats needs mapper processes, "
+                    "it cannot be used with --threads\n");
+    return 1;
+  }
+
+  // wall clock of the whole job and of each phase for --stats
+  stats_t job;
+  stats_start(&job);
+  double scan_end, map_start, map_end, reduce_start, reduce_end;
+
+  char *dir_name = argv[optind];
+  int n_mappers = atoi(argv[optind + 1]);
+  int n_reducers = atoi(argv[optind + 2]);
 
   if (n_mappers < 1 || n_reducers < 1) {
     fprintf(stderr, "mapreduce: cannot have less than one mapper or reducer\n");
@@ -68,67 +764,145 @@ int main(int argc, char *argv[]) {
     return 1;
   }
 
-  if (mkdir("./intermediate", 0777) < 0 && errno != EEXIST) {
-    perror("mkdir intermediate");
-    return 1;
+  // Give every mapper about the same number of bytes by cutting large
+  // files into line aligned chunks instead of handing them out whole
+  off_t total = 0;
+  off_t sizes[file_count];
+  for (int i = 0; i < file_count; i++) {
+    struct stat st;
+    if (stat(files[i], &st) != 0) {
+      perror("stat");
+      return 1;
+    }
+    sizes[i] = st.st_size;
+    total += st.st_size;
   }
 
-  int files_per_mapper = file_count / n_mappers;
-  int remainder = file_count % n_mappers;
-  int file_index = 0;
-
-  pid_t mapper_pids[n_mappers];
+  // With --dynamic mappers pull tasks from a shared queue until it is
+  // drained, so tasks are cut smaller to let fast mappers absorb the
+  // work of slow ones instead of predicting their cost up front
+  off_t n_pieces = (off_t)n_mappers * (dynamic || threads ? QUEUE_SPLIT : 1);
+  off_t chunk = (total + n_pieces - 1) / n_pieces;
+  if (chunk < MIN_CHUNK)
+    chunk = MIN_CHUNK;
 
-  for (int i = 0; i < n_mappers; i++) {
-    int count = files_per_mapper + (i < remainder ? 1 : 0);
+  struct map_task *tasks = NULL;
+  int n_tasks = 0, task_cap = 0;
+  for (int i = 0; i < file_count; i++) {
+    if (add_tasks(&tasks, &n_tasks, &task_cap, files[i], sizes[i], chunk) != 0)
+      return 1;
+  }
+  scan_end = stats_now();
 
-    pid_t pid = fork();
-    if (pid < 0) {
-      perror("fork");
+  // --threads runs the whole job in this process, with map threads
+  // pulling tasks largest first, and never touches ./intermediate
+  if (threads) {
+    qsort(tasks, n_tasks, sizeof(struct map_task), cmp_task);
+    char **args = malloc(sizeof(char *) * n_tasks);
+    if (!args) {
+      fprintf(stderr, "malloc failed\n");
       return 1;
     }
+    for (int t = 0; t < n_tasks; t++)
+      args[t] = tasks[t].arg;
+    int ret = run_threads(args, n_tasks, n_mappers, n_reducers, verbose);
+    free(args);
+    free(tasks);
+    for (int i = 0; i < file_count; i++)
+      free(files[i]);
+    return ret != 0;
+  }
 
-    if (pid == 0) {
-      char outfile[MAX_PATH];
-      snprintf(outfile, sizeof(outfile), "./intermediate/%d.tbl", i);
-
-      char *args[count + 3];
-      args[0] = "./map";
-      args[1] = outfile;
+  if (mkdir("./intermediate", 0777) < 0 && errno != EEXIST) {
+    perror("mkdir intermediate");
+    return 1;
+  }
 
-      for (int j = 0; j < count; j++) {
-        args[j + 2] = files[file_index + j];
+  // Reducers read every table in ./intermediate, so drop the ones left
+  // behind by an earlier run with more mappers, and any spilled runs of
+  // a mapper that did not finish
+  dir = opendir("./intermediate");
+  if (dir) {
+    while ((entry = readdir(dir)) != NULL) {
+      if (strstr(entry->d_name, ".tbl")) {
+        char path[MAX_PATH];
+        snprintf(path, sizeof(path), "./intermediate/%s", entry->d_name);
+        unlink(path);
       }
-      args[count + 2] = NULL;
-
-      execv("./map", args);
-      perror("execv failed");
-      exit(1);
-    } else {
-      mapper_pids[i] = pid;
-      file_index += count;
     }
+    closedir(dir);
   }
 
-  for (int i = 0; i < n_mappers; i++) {
-    int status;
-    waitpid(mapper_pids[i], &status, 0);
-    if (!WIFEXITED(status) || WEXITSTATUS(status) != 0) {
-      fprintf(stderr, "mapreduce: mapper %d failed\n", i);
+  off_t load[n_mappers];
+  int counts[n_mappers];
+  int queue[2] = {-1, -1};
+  if (dynamic) {
+    qsort(tasks, n_tasks, sizeof(struct map_task), cmp_task);
+    if (pipe(queue) != 0) {
+      perror("pipe");
       return 1;
     }
+    if (verbose) {
+      fprintf(stderr, "mapreduce: queued %d tasks of at most %lld bytes\n",
+              n_tasks, (long long)chunk);
+    }
+  } else {
+    balance_tasks(tasks, n_tasks, load, counts, n_mappers);
+    if (verbose) {
+      for (int i = 0; i < n_mappers; i++) {
+        fprintf(stderr, "mapreduce: mapper %d: %d tasks, %lld bytes\n", i,
+                counts[i], (long long)load[i]);
+      }
+    }
   }
 
-  int range_per_reducer = 256 / n_reducers;
-  int range_remainder = 256 % n_reducers;
+  // mappers left without work still write an (empty) intermediate table
+  char empty_task[TASK_LEN];
+  snprintf(empty_task, sizeof(empty_task), "%s:0:0", files[0]);
 
+  // With --pipes every mapper gets a pipe to every reducer and sends it
+  // its slice of an even split of the key space. Reducers are started
+  // with the mappers and merge records as they arrive, so nothing goes
+  // through ./intermediate.
+  uint64_t bounds[n_reducers + 1];
   pid_t reducer_pids[n_reducers];
+  for (int i = 0; i < n_reducers; i++)
+    reducer_pids[i] = -1;
+  int (*shuffle)[2] = NULL;
+  // the grid is open all at once in this process, two fds per pipe
+  long long fd_limit;
+  if (pipes &&
+      reserve_fds(2LL * n_mappers * n_reducers, &fd_limit) != 0) {
+    fprintf(stderr, "mapreduce: --pipes needs %lld file descriptors for "
+                    "%d x %d pipes but the limit is %lld, shuffling through "
+                    "./intermediate instead\n",
+            2LL * n_mappers * n_reducers, n_mappers, n_reducers, fd_limit);
+    pipes = 0;
+  }
+  if (pipes) {
+    shuffle = malloc(sizeof(*shuffle) * n_mappers * n_reducers);
+    if (!shuffle) {
+      fprintf(stderr, "malloc failed\n");
+      return 1;
+    }
+    for (int p = 0; p < n_mappers * n_reducers; p++) {
+      if (pipe(shuffle[p]) != 0) {
+        perror("pipe");
+        return 1;
+      }
+    }
+    for (int i = 0; i <= n_reducers; i++)
+      bounds[i] = KEY_SPLIT(i, n_reducers);
+  }
+  struct reduce_plan plan = {bounds,     shuffle,    NULL,
+                             n_mappers,  n_reducers, queue,
+                             stats_file, group_by != NULL,
+                             aggregates, top_k ? topk_cap : NULL};
 
-  for (int i = 0; i < n_reducers; i++) {
-    int start_ip =
-        i * range_per_reducer + (i < range_remainder ? i : range_remainder);
-    int end_ip = start_ip + range_per_reducer + (i < range_remainder ? 1 : 0);
+  map_start = stats_now();
+  pid_t mapper_pids[n_mappers];
 
+  for (int i = 0; i < n_mappers; i++) {
     pid_t pid = fork();
     if (pid < 0) {
       perror("fork");
@@ -137,123 +911,291 @@ int main(int argc, char *argv[]) {
 
     if (pid == 0) {
       char outfile[MAX_PATH];
-      snprintf(outfile, sizeof(outfile), "./out/%d.tbl", i);
+      snprintf(outfile, sizeof(outfile), "./intermediate/%d.tbl", i);
+
+      char *args[n_tasks + 13];
+      int n_args = 0;
+      args[n_args++] = "./map";
+      if (map_memory) {
+        args[n_args++] = "--memory";
+        args[n_args++] = map_memory;
+      }
 
-      char start_str[4], end_str[4];
-      snprintf(start_str, sizeof(start_str), "%d", start_ip);
-      snprintf(end_str, sizeof(end_str), "%d", end_ip);
+      if (shuffle) {
+        keep_shuffle(shuffle, n_mappers, n_reducers, i, -1);
+        args[n_args++] = "--pipes";
+        args[n_args++] = shuffle_list(shuffle, n_mappers, n_reducers, i, -1);
+        if (!args[n_args - 1])
+          exit(1);
+      }
+
+      char queue_str[16];
+      if (dynamic) {
+        // the write end must be closed or the queue never reaches EOF
+        close(queue[1]);
+        snprintf(queue_str, sizeof(queue_str), "%d", queue[0]);
+        args[n_args++] = "--queue";
+        args[n_args++] = queue_str;
+      }
+
+      if (group_by) {
+        args[n_args++] = "--group";
+        args[n_args++] = group_by;
+      }
+      if (aggregates)
+        args[n_args++] = "--aggregates";
+      if (top_k) {
+        args[n_args++] = "--top-k";
+        args[n_args++] = topk_cap;
+      }
+
+      char stats_path[MAX_PATH];
+      if (stats_file) {
+        snprintf(stats_path, sizeof(stats_path), "%s.map%d", stats_file, i);
+        args[n_args++] = "--stats";
+        args[n_args++] = stats_path;
+      }
 
-      char *args[] = {"./reduce", "./intermediate", outfile,
-                      start_str,  end_str,          NULL};
-      execv("./reduce", args);
+      if (!shuffle)
+        args[n_args++] = outfile;
+
+      if (!dynamic) {
+        for (int t = 0; t < n_tasks; t++) {
+          if (tasks[t].mapper == i)
+            args[n_args++] = tasks[t].arg;
+        }
+        if (counts[i] == 0) {
+          args[n_args++] = empty_task;
+        }
+      }
+      args[n_args] = NULL;
+
+      execv("./map", args);
       perror("execv failed");
       exit(1);
     } else {
-      reducer_pids[i] = pid;
+      mapper_pids[i] = pid;
     }
   }
 
-  for (int i = 0; i < n_reducers; i++) {
-    int status;
-    waitpid(reducer_pids[i], &status, 0);
-    if (!WIFEXITED(status) || WEXITSTATUS(status) != 0) {
-      fprintf(stderr, "mapreduce: reducer %d failed\n", i);
-      return 1;
+  if (pipes) {
+    reduce_start = stats_now();
+    for (int i = 0; i < n_reducers; i++) {
+      reducer_pids[i] = spawn_reducer(i, &plan);
+      if (reducer_pids[i] < 0) {
+        stop_children(mapper_pids, n_mappers);
+        stop_children(reducer_pids, n_reducers);
+        return 1;
+      }
     }
+    keep_shuffle(shuffle, n_mappers, n_reducers, -1, -1);
+    free(shuffle);
   }
 
-  table_t *global = table_init();
-  if (!global) {
-    fprintf(stderr, "Failed to init global table\n");
-    return 1;
-  }
-
-  dir = opendir("./out");
-  if (!dir) {
-    perror("opendir out");
-    table_free(global);
-    return 1;
+  if (dynamic) {
+    // A record is written whole or not at all. If every mapper has died
+    // the write fails with EPIPE instead of killing us, and the failure
+    // is reported when the mappers are waited on below.
+    close(queue[0]);
+    signal(SIGPIPE, SIG_IGN);
+    char record[TASK_LEN];
+    for (int t = 0; t < n_tasks; t++) {
+      strncpy(record, tasks[t].arg, TASK_LEN);
+      if (write(queue[1], record, TASK_LEN) != TASK_LEN) {
+        perror("write");
+        break;
+      }
+    }
+    close(queue[1]);
+    queue[0] = queue[1] = -1;
   }
 
-  while ((entry = readdir(dir)) != NULL) {
-    if (strcmp(entry->d_name, ".") == 0 || strcmp(entry->d_name, "..") == 0)
-      continue;
-
-    char path[MAX_PATH];
-    snprintf(path, MAX_PATH, "./out/%s", entry->d_name);
-
-    table_t *t = table_from_file(path);
-    if (!t) {
-      fprintf(stderr, "Failed to load table from %s\n", path);
-      continue;
+  // With --overlap the reducers start as soon as the first mapper is
+  // done, with bounds sampled from its table, and the parent sends every
+  // reducer the path of each intermediate table as its mapper exits, so
+  // reducing overlaps with the slowest mappers
+  if (overlap) {
+    int (*manifest)[2] = malloc(sizeof(*manifest) * n_reducers);
+    if (!manifest) {
+      fprintf(stderr, "malloc failed\n");
+      return 1;
+    }
+    for (int r = 0; r < n_reducers; r++) {
+      if (pipe(manifest[r]) != 0) {
+        perror("pipe");
+        return 1;
+      }
     }
+    // a reducer that died is reported when it is waited on below
+    signal(SIGPIPE, SIG_IGN);
 
-    for (int i = 0; i < TABLE_LEN; i++) {
-      bucket_t *b = t->buckets[i];
-      while (b) {
-        bucket_t *g = table_get(global, b->ip);
-        if (g) {
-          g->requests += b->requests;
-        } else {
-          bucket_t *nb = bucket_init(b->ip);
-          if (!nb) {
-            table_free(t);
-            closedir(dir);
-            table_free(global);
-            return 1;
-          }
-          nb->requests = b->requests;
-          if (table_add(global, nb) != 0) {
-            free(nb);
-            table_free(t);
-            closedir(dir);
-            table_free(global);
+    int finished[n_mappers];
+    for (int done = 0; done < n_mappers; done++) {
+      int status;
+      pid_t pid = wait(&status);
+      int i = 0;
+      while (i < n_mappers && mapper_pids[i] != pid)
+        i++;
+      if (i == n_mappers) {
+        fprintf(stderr, "mapreduce: reducer failed\n");
+        for (int r = 0; r < n_reducers; r++) {
+          if (reducer_pids[r] == pid)
+            reducer_pids[r] = -1;
+        }
+        stop_children(mapper_pids, n_mappers);
+        stop_children(reducer_pids, n_reducers);
+        return 1;
+      }
+      mapper_pids[i] = -1;
+      if (!WIFEXITED(status) || WEXITSTATUS(status) != 0) {
+        fprintf(stderr, "mapreduce: mapper %d failed\n", i);
+        stop_children(mapper_pids, n_mappers);
+        stop_children(reducer_pids, n_reducers);
+        return 1;
+      }
+      finished[done] = i;
+      if (verbose)
+        fprintf(stderr, "mapreduce: mapper %d done\n", i);
+
+      if (done == 0) {
+        reduce_start = stats_now();
+        plan.manifest = manifest;
+        if (pick_bounds(finished, 1, bounds, n_reducers) != 0) {
+          stop_children(mapper_pids, n_mappers);
+          return 1;
+        }
+        for (int r = 0; r < n_reducers; r++) {
+          reducer_pids[r] = spawn_reducer(r, &plan);
+          if (reducer_pids[r] < 0) {
+            stop_children(mapper_pids, n_mappers);
+            stop_children(reducer_pids, n_reducers);
             return 1;
           }
         }
-        b = b->next;
+        for (int r = 0; r < n_reducers; r++)
+          close(manifest[r][0]);
+      }
+
+      char line[MAX_PATH];
+      int len = snprintf(line, sizeof(line), "./intermediate/%d.tbl\n", i);
+      for (int r = 0; r < n_reducers; r++) {
+        if (write(manifest[r][1], line, len) != len) {
+          perror("write");
+          break;
+        }
+      }
+    }
+    for (int r = 0; r < n_reducers; r++)
+      close(manifest[r][1]);
+    free(manifest);
+  } else {
+    for (int i = 0; i < n_mappers; i++) {
+      int status;
+      waitpid(mapper_pids[i], &status, 0);
+      mapper_pids[i] = -1;
+      if (!WIFEXITED(status) || WEXITSTATUS(status) != 0) {
+        fprintf(stderr, "mapreduce: mapper %d failed\n", i);
+        // with --pipes the reducers are already running
+        stop_children(mapper_pids, n_mappers);
+        stop_children(reducer_pids, n_reducers);
+        return 1;
       }
     }
-    table_free(t);
   }
-  closedir(dir);
 
-  int count = 0;
-  for (int i = 0; i < TABLE_LEN; i++) {
-    bucket_t *b = global->buckets[i];
-    while (b) {
-      count++;
-      b = b->next;
+  map_end = stats_now();
+
+  if (!pipes && !overlap) {
+    reduce_start = map_end;
+    int all[n_mappers];
+    for (int i = 0; i < n_mappers; i++)
+      all[i] = i;
+    // composite keys are shuffled by hash, which is already even, and
+    // summaries are too small to be worth sampling
+    if (group_by || top_k) {
+      for (int i = 0; i <= n_reducers; i++)
+        bounds[i] = KEY_SPLIT(i, n_reducers);
+    } else if (pick_bounds(all, n_mappers, bounds, n_reducers) != 0) {
+      return 1;
+    }
+    for (int i = 0; i < n_reducers; i++) {
+      reducer_pids[i] = spawn_reducer(i, &plan);
+      if (reducer_pids[i] < 0)
+        return 1;
     }
   }
 
-  struct record *arr = malloc(sizeof(struct record) * count);
-  if (!arr) {
-    fprintf(stderr, "malloc failed\n");
-    table_free(global);
-    return 1;
+  for (int i = 0; i < n_reducers; i++) {
+    int status;
+    waitpid(reducer_pids[i], &status, 0);
+    reducer_pids[i] = -1;
+    if (!WIFEXITED(status) || WEXITSTATUS(status) != 0) {
+      fprintf(stderr, "mapreduce: reducer %d failed\n", i);
+      stop_children(reducer_pids, n_reducers);
+      return 1;
+    }
   }
+  reduce_end = stats_now();
 
-  int idx = 0;
-  for (int i = 0; i < TABLE_LEN; i++) {
-    bucket_t *b = global->buckets[i];
-    while (b) {
-      strncpy(arr[idx].ip, b->ip, IP_LEN);
-      arr[idx].ip[IP_LEN - 1] = '\0';
-      arr[idx].requests = b->requests;
-      idx++;
-      b = b->next;
+  if (verbose && !group_by && !top_k) {
+    for (int i = 0; i < n_reducers; i++) {
+      char path[MAX_PATH];
+      snprintf(path, sizeof(path), "./out/%d.tbl", i);
+      table_view_t *view = table_view_open(path);
+      size_t keys = view ? view->count : 0;
+      long long requests = 0;
+      for (size_t k = 0; k < keys; k++)
+        requests += view->records[k].requests;
+      char start_str[IP_LEN], end_str[IP_LEN];
+      format_bound(bounds[i], start_str, sizeof(start_str));
+      format_bound(bounds[i + 1], end_str, sizeof(end_str));
+      fprintf(stderr, "mapreduce: reducer %d: [%s, %s) %zu keys, %lld records\n",
+              i, start_str, end_str, keys, requests);
+      table_view_close(view);
     }
   }
 
-  qsort(arr, count, sizeof(struct record), cmp_record);
+  if (top_k) {
+    if (print_topk(n_reducers, top_k, verbose) != 0)
+      return 1;
+  } else if (group_by) {
+    if (print_groups(n_reducers, verbose, aggregates, window != NULL) != 0)
+      return 1;
+  } else {
+    // Reducers own disjoint, increasing key ranges and write their tables
+    // sorted, so printing them in reducer order is already sorted by IP.
+    // Only read the tables this run wrote, ./out may still hold tables of an
+    // earlier run with more reducers.
+    for (int r = 0; r < n_reducers; r++) {
+      char path[MAX_PATH];
+      snprintf(path, MAX_PATH, "./out/%d.tbl", r);
+
+      table_view_t *view = table_view_open(path);
+      if (!view || table_view_verify(view, path) != 0) {
+        fprintf(stderr, "Failed to load table from %s\n", path);
+        table_view_close(view);
+        return 1;
+      }
 
-  for (int i = 0; i < count; i++) {
-    printf("%s - %d\n", arr[i].ip, arr[i].requests);
+      int ret = records_print(stdout, view->records, view->count);
+      table_view_close(view);
+      if (ret != 0)
+        return 1;
+    }
+  }
+
+  if (stats_file) {
+    fflush(stdout);
+    double phase_sec[N_PHASES] = {
+        scan_end - job.start, map_end - map_start,
+        reduce_end - reduce_start, stats_now() - reduce_end};
+    stats_stop(&job, 1);
+    if (write_report(stats_file, &job, phase_sec, n_mappers,
+                     n_reducers) != 0)
+      return 1;
   }
 
-  free(arr);
-  table_free(global);
+  free(tasks);
 
   for (int i = 0; i < file_count; i++)
     free(files[i]);
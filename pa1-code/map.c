@@ -1,80 +1,213 @@
 #include "map.h"
+#include <getopt.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <sys/stat.h>
+#include <unistd.h>
 
-int map_log(table_t *table, const char file_path[MAX_PATH]) {
-  if (!table || !file_path)
+// Parse a byte count with an optional k, m or g suffix
+static int parse_size(const char *arg, size_t *size) {
+  char *end;
+  unsigned long long value = strtoull(arg, &end, 10);
+  if (end == arg) {
     return -1;
-
-  FILE *fp = fopen(file_path, "r");
-  if (!fp) {
-    perror("fopen");
+  }
+  const char *suffixes = "kmg";
+  const char *suffix = *end ? strchr(suffixes, *end | 0x20) : NULL;
+  if (suffix != NULL) {
+    value <<= 10 * (suffix - suffixes + 1);
+    end++;
+  }
+  if (*end != '\0') {
     return -1;
   }
+  *size = (size_t)value;
+  return 0;
+}
 
-  char line[1024];
-  char timestamp[64], ip[IP_LEN], method[16], path[512], status[8];
-
-  while (fgets(line, sizeof(line), fp)) {
-    line[strcspn(line, "\r\n")] = '\0';
-
-    char *p = line;
-    while (*p == ' ' || *p == '\t')
-      p++;
-
-    if (sscanf(p, "%63[^,],%15[^,],%15[^,],%511[^,],%7s", timestamp, ip, method,
-               path, status) < 2) {
-      continue;
-    }
-
-    bucket_t *bucket = table_get(table, ip);
-    if (bucket) {
-      bucket->requests += 1;
+int main(int argc, char *argv[]) {
+  static const struct option options[] = {
+      {"mmap", no_argument, NULL, 'm'},
+      {"queue", required_argument, NULL, 'q'},
+      {"memory", required_argument, NULL, 'b'},
+      {"pipes", required_argument, NULL, 'p'},
+      {"stats", required_argument, NULL, 's'},
+      {"group", required_argument, NULL, 'g'},
+      {"aggregates", no_argument, NULL, 'a'},
+      {"top-k", required_argument, NULL, 'k'},
+      {NULL, 0, NULL, 0},
+  };
+  int use_mmap = 0;
+  int queue_fd = -1;
+  size_t budget = 0;
+  int *pipe_fds = NULL;
+  int n_pipes = 0;
+  const char *stats_file = NULL;
+  const char *group_by = NULL;
+  int aggregates = 0;
+  group_spec_t group_spec;
+  group_table_t *group = NULL;
+  size_t topk_cap = 0;
+  topk_t *topk = NULL;
+  stats_t stats;
+  stats_start(&stats);
+  int opt;
+  while ((opt = getopt_long(argc, argv, "", options, NULL)) != -1) {
+    if (opt == 'm') {
+      use_mmap = 1;
+    } else if (opt == 'q' && parse_fd(optarg, &queue_fd) == 0) {
+      // tasks are pulled from queue_fd
+    } else if (opt == 'b' && parse_size(optarg, &budget) == 0) {
+      // budget is set
+    } else if (opt == 'p' && !pipe_fds &&
+               (n_pipes = parse_fd_list(optarg, &pipe_fds)) > 0) {
+      // records go to reducers through pipe_fds
+    } else if (opt == 's') {
+      stats_file = optarg;
+      map_set_stats(&stats);
+    } else if (opt == 'g') {
+      group_by = optarg;
+    } else if (opt == 'a') {
+      aggregates = 1;
+    } else if (opt == 'k' && parse_count(optarg, &topk_cap) == 0) {
+      // counters go to a summary of topk_cap counters
     } else {
-      bucket = bucket_init(ip);
-      if (!bucket)
-        continue;
-      bucket->requests = 1;
-      if (table_add(table, bucket) != 0) {
-        free(bucket);
-        continue;
-      }
+      fprintf(stderr, "Usage: map <outfile> <infiles...>\n");
+      return EXIT_FAILURE;
     }
   }
 
-  fclose(fp);
-  return 0;
-}
-
-int main(int argc, char *argv[]) {
-  if (argc < 3) {
+  // with a work queue the inputs come from the queue instead of argv,
+  // with pipes there is no output file
+  // aggregates other than the count only live in group tables
+  int first_input = optind + (pipe_fds ? 0 : 1);
+  if (argc - first_input < (queue_fd >= 0 ? 0 : 1) ||
+      (pipe_fds && budget > 0) || (group_by && (pipe_fds || budget > 0)) ||
+      (aggregates && !group_by) ||
+      (topk_cap > 0 && (pipe_fds || budget > 0 || group_by)) ||
+      (group_by && group_parse(group_by, aggregates, &group_spec) != 0)) {
     fprintf(stderr, "Usage: map <outfile> <infiles...>\n");
+    free(pipe_fds);
     return EXIT_FAILURE;
   }
+  if (group_by) {
+    group = group_table_init(aggregates);
+    if (!group) {
+      fprintf(stderr, "Failed to initialize table\n");
+      free(pipe_fds);
+      return EXIT_FAILURE;
+    }
+    map_set_group(group, &group_spec);
+  }
+  if (topk_cap > 0) {
+    topk = topk_init(topk_cap);
+    if (!topk) {
+      fprintf(stderr, "Failed to initialize summary\n");
+      free(pipe_fds);
+      group_table_free(group);
+      return EXIT_FAILURE;
+    }
+    map_set_topk(topk);
+  }
 
-  const char *output_table = argv[1];
+  const char *output_table = pipe_fds ? NULL : argv[optind];
+  if (output_table)
+    map_set_budget(budget, output_table);
 
   table_t *table = table_init();
   if (!table) {
     fprintf(stderr, "Failed to initialize table\n");
+    free(pipe_fds);
+    group_table_free(group);
+    topk_free(topk);
     return EXIT_FAILURE;
   }
 
-  for (int i = 2; i < argc; i++) {
-    if (map_log(table, argv[i]) != 0) {
+  for (int i = first_input; i < argc; i++) {
+    if (map_input(table, argv[i], use_mmap) != 0) {
       fprintf(stderr, "Failed to map log file: %s\n", argv[i]);
       table_free(table);
       return EXIT_FAILURE;
     }
   }
 
-  if (table_to_file(table, output_table) != 0) {
-    fprintf(stderr, "Failed to save table to file: %s\n", output_table);
+  // Pull tasks until every writer has closed the queue. Every record is
+  // written whole and in one piece, so a read returns a full record and
+  // mappers sharing the queue never split one between them.
+  if (queue_fd >= 0) {
+    char task[TASK_LEN];
+    ssize_t n;
+    while ((n = read(queue_fd, task, TASK_LEN)) == TASK_LEN) {
+      task[TASK_LEN - 1] = '\0';
+      if (map_input(table, task, use_mmap) != 0) {
+        fprintf(stderr, "Failed to map log file: %s\n", task);
+        table_free(table);
+        return EXIT_FAILURE;
+      }
+    }
+    if (n != 0) {
+      if (n < 0)
+        perror("read");
+      else
+        fprintf(stderr, "map: short read from work queue\n");
+      table_free(table);
+      return EXIT_FAILURE;
+    }
+    close(queue_fd);
+  }
+
+  if (group) {
     table_free(table);
-    return EXIT_FAILURE;
+    stats.keys = group->count;
+    stats.bytes_written = table_file_size(group->count, group->record_size);
+    int ret = group_to_file(group, output_table);
+    group_table_free(group);
+    if (ret != 0) {
+      fprintf(stderr, "Failed to save table to file: %s\n", output_table);
+      return EXIT_FAILURE;
+    }
+  } else if (topk) {
+    table_free(table);
+    stats.keys = topk->count;
+    stats.bytes_written = table_file_size(topk->count, sizeof(topk_entry_t));
+    int ret = topk_to_file(topk, output_table);
+    topk_free(topk);
+    if (ret != 0) {
+      fprintf(stderr, "Failed to save summary to file: %s\n", output_table);
+      return EXIT_FAILURE;
+    }
+  } else if (pipe_fds) {
+    stats.keys = table->count;
+    stats.bytes_written = table->count * sizeof(record_t);
+    int ret = map_finish_pipes(table, pipe_fds, n_pipes);
+    free(pipe_fds);
+    table_free(table);
+    if (ret != 0)
+      return EXIT_FAILURE;
+  } else {
+    if (map_finish(table, output_table) != 0) {
+      fprintf(stderr, "Failed to save table to file: %s\n", output_table);
+      table_free(table);
+      return EXIT_FAILURE;
+    }
+    table_free(table);
+
+    // with spilled runs the table only held the last one, so count the
+    // keys in the file instead
+    struct stat st;
+    if (stats_file && stat(output_table, &st) == 0) {
+      size_t keys;
+      stats.bytes_written = st.st_size;
+      if (table_file_count(output_table, &keys) == 0)
+        stats.keys = keys;
+    }
   }
 
-  table_free(table);
+  if (stats_file) {
+    stats_stop(&stats, 0);
+    if (stats_write(stats_file, &stats) != 0)
+      return EXIT_FAILURE;
+  }
   return EXIT_SUCCESS;
 }
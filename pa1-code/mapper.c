@@ -0,0 +1,373 @@
+#include "map.h"
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#define SPILL_PATH_LEN (MAX_PATH + 16)
+
+// Spill state of this mapper, see map_set_budget
+static size_t spill_keys;          // spill once the table holds this many IPs
+static char spill_base[MAX_PATH];
+static int spill_runs;
+static int spill_failed;
+
+static stats_t *map_stats;         // see map_set_stats
+
+// Composite key counting, see map_set_group
+static group_table_t *map_group;
+static const group_spec_t *map_group_spec;
+
+static topk_t *map_topk;           // see map_set_topk
+
+static int map_spill(table_t *table);
+
+int log_split(const char *line, size_t len, log_span_t fields[],
+              int n_fields) {
+  const char *end = line + len;
+  for (int i = 0; i < n_fields; i++) {
+    const char *comma = memchr(line, ',', end - line);
+    const char *stop = comma ? comma : end;
+    if (stop == line) {
+      return -1;
+    }
+    fields[i].start = line;
+    fields[i].len = stop - line;
+    if (comma == NULL) {
+      return i + 1 == n_fields ? 0 : -1;
+    }
+    line = comma + 1;
+  }
+  return 0;
+}
+
+int map_line(table_t *table, const char *line, size_t len) {
+  if (map_group) {
+    return group_line(map_group, map_group_spec, line, len);
+  }
+
+  while (len > 0 && (*line == ' ' || *line == '\t')) {
+    line++;
+    len--;
+  }
+
+  log_span_t fields[LOG_IP + 1];
+  uint32_t key;
+  if (log_split(line, len, fields, LOG_IP + 1) != 0 ||
+      ip_to_key_n(fields[LOG_IP].start, fields[LOG_IP].len, &key) != 0) {
+    return 1;
+  }
+  if (map_topk) {
+    return topk_add(map_topk, key, 1);
+  }
+
+  bucket_t *bucket = table_get_key(table, key);
+  if (bucket == NULL) {
+    bucket = table_add_key(table, key);
+    if (bucket == NULL) {
+      return -1;
+    }
+    bucket->requests = 1;
+    if (spill_keys > 0 && table->count >= spill_keys) {
+      return map_spill(table);
+    }
+    return 0;
+  }
+  bucket->requests += 1;
+  return 0;
+}
+
+void map_set_budget(size_t budget, const char out_file[MAX_PATH]) {
+  spill_keys = budget / MAP_BYTES_PER_KEY;
+  if (budget > 0 && spill_keys < MAP_MIN_SPILL_KEYS) {
+    spill_keys = MAP_MIN_SPILL_KEYS;
+  }
+  snprintf(spill_base, sizeof(spill_base), "%s", out_file);
+}
+
+void map_set_stats(stats_t *stats) {
+  map_stats = stats;
+}
+
+void map_set_group(group_table_t *group, const group_spec_t *spec) {
+  map_group = group;
+  map_group_spec = spec;
+}
+
+void map_set_topk(topk_t *topk) {
+  map_topk = topk;
+}
+
+static void spill_path(int run, char path[SPILL_PATH_LEN]) {
+  snprintf(path, SPILL_PATH_LEN, "%s.spill%d", spill_base, run);
+}
+
+// Merge every run spilled so far into out_file and remove them
+static int merge_runs(const char *out_file) {
+  char (*paths)[SPILL_PATH_LEN] = malloc(spill_runs * sizeof(*paths));
+  const char **runs = malloc(spill_runs * sizeof(char *));
+  int ret = -1;
+  if (paths != NULL && runs != NULL) {
+    for (int i = 0; i < spill_runs; i++) {
+      spill_path(i, paths[i]);
+      runs[i] = paths[i];
+    }
+    ret = table_merge(runs, spill_runs, 0, KEY_SPACE, out_file, NULL);
+    for (int i = 0; i < spill_runs; i++) {
+      unlink(paths[i]);
+    }
+    spill_runs = 0;
+  }
+  free(runs);
+  free(paths);
+  return ret;
+}
+
+// Write the table to the next run file and empty it. Once MAP_MAX_RUNS
+// runs pile up they are merged into one, so the final merge never needs
+// more than MAP_MAX_RUNS open files.
+static int map_spill(table_t *table) {
+  char path[SPILL_PATH_LEN];
+  spill_path(spill_runs, path);
+  if (table_to_file(table, path) != 0) {
+    fprintf(stderr, "map: failed to spill to %s\n", path);
+    spill_failed = 1;
+    return -1;
+  }
+  spill_runs++;
+  table_clear(table);
+
+  if (spill_runs == MAP_MAX_RUNS) {
+    char merged[SPILL_PATH_LEN];
+    snprintf(merged, sizeof(merged), "%s.merged", spill_base);
+    char first[SPILL_PATH_LEN];
+    spill_path(0, first);
+    if (merge_runs(merged) != 0 || rename(merged, first) != 0) {
+      fprintf(stderr, "map: failed to merge spilled runs\n");
+      spill_failed = 1;
+      return -1;
+    }
+    spill_runs = 1;
+  }
+  return 0;
+}
+
+int map_finish(table_t *table, const char out_file[MAX_PATH]) {
+  if (spill_failed) {
+    return -1;
+  }
+  if (spill_runs == 0) {
+    return table_to_file(table, out_file);
+  }
+  if (table->count > 0 && map_spill(table) != 0) {
+    return -1;
+  }
+  return merge_runs(out_file);
+}
+
+int map_finish_pipes(table_t *table, const int fds[], int n_pipes) {
+  record_t *records = malloc(table->count ? table->count * sizeof(record_t) : 1);
+  if (records == NULL) {
+    return -1;
+  }
+  for (size_t i = 0; i < table->count; i++) {
+    records[i].key = table->buckets[i]->key;
+    records[i].requests = table->buckets[i]->requests;
+  }
+  records_sort(records, table->count);
+
+  int ret = 0;
+  size_t from = 0;
+  for (int r = 0; r < n_pipes; r++) {
+    size_t to = records_lower_bound(records, table->count,
+                                    KEY_SPLIT(r + 1, n_pipes));
+    if (ret == 0 && records_write_fd(fds[r], records + from, to - from) != 0)
+      ret = -1;
+    close(fds[r]);
+    from = to;
+  }
+  free(records);
+  return ret;
+}
+
+// Count every line read from fp, one fgets buffer at a time,
+// stopping once limit bytes have been consumed if limit is not -1
+//
+// Return 0 on success, -1 as soon as a line fails to be counted
+static int map_stream(table_t *table, FILE *fp, off_t limit) {
+  char line[1024];
+  off_t consumed = 0;
+  long long lines = 0, rejected = 0;
+
+  while ((limit < 0 || consumed < limit) && fgets(line, sizeof(line), fp)) {
+    size_t read = strlen(line);
+    consumed += read;
+    lines++;
+    int ret = map_line(table, line, strcspn(line, "\r\n"));
+    if (ret < 0) {
+      fprintf(stderr, "map: failed to count a line\n");
+      return -1;
+    }
+    rejected += ret;
+  }
+  if (map_stats) {
+    map_stats->lines += lines;
+    map_stats->rejected += rejected;
+    map_stats->bytes_read += consumed;
+  }
+  return 0;
+}
+
+// Count every line of the len bytes at data
+//
+// Return 0 on success, -1 as soon as a line fails to be counted
+static int map_buffer(table_t *table, const char *data, size_t len) {
+  const char *p = data;
+  const char *end = data + len;
+  long long lines = 0, rejected = 0;
+  while (p < end) {
+    const char *nl = memchr(p, '\n', end - p);
+    const char *eol = nl ? nl : end;
+    size_t line_len = eol - p;
+    if (line_len > 0 && p[line_len - 1] == '\r') {
+      line_len--;
+    }
+    lines++;
+    int ret = map_line(table, p, line_len);
+    if (ret < 0) {
+      fprintf(stderr, "map: failed to count a line\n");
+      return -1;
+    }
+    rejected += ret;
+    p = eol + 1;
+  }
+  if (map_stats) {
+    map_stats->lines += lines;
+    map_stats->rejected += rejected;
+    map_stats->bytes_read += len;
+  }
+  return 0;
+}
+
+int map_log(table_t *table, const char file_path[MAX_PATH]) {
+  if (!table || !file_path)
+    return -1;
+
+  FILE *fp = fopen(file_path, "r");
+  if (!fp) {
+    perror("fopen");
+    return -1;
+  }
+
+  int ret = map_stream(table, fp, -1);
+
+  fclose(fp);
+  return ret;
+}
+
+int map_log_mmap(table_t *table, const char file_path[MAX_PATH]) {
+  return map_chunk(table, file_path, 0, -1, 1);
+}
+
+int map_chunk(table_t *table, const char file_path[MAX_PATH], off_t offset,
+              off_t length, int use_mmap) {
+  if (!table || !file_path || offset < 0)
+    return -1;
+
+  int fd = open(file_path, O_RDONLY);
+  if (fd < 0) {
+    perror("open");
+    return -1;
+  }
+
+  struct stat st;
+  if (fstat(fd, &st) != 0) {
+    perror("fstat");
+    close(fd);
+    return -1;
+  }
+
+  if (S_ISREG(st.st_mode)) {
+    off_t remaining = offset < st.st_size ? st.st_size - offset : 0;
+    if (length < 0 || length > remaining) {
+      length = remaining;
+    }
+  }
+
+  // mmap offsets must be page aligned, so map from the page holding
+  // offset and skip the bytes before it
+  if (use_mmap && S_ISREG(st.st_mode) && length > 0) {
+    off_t page = sysconf(_SC_PAGESIZE);
+    off_t start = offset - offset % page;
+    size_t size = (size_t)(offset - start + length);
+    char *data = mmap(NULL, size, PROT_READ, MAP_PRIVATE, fd, start);
+    close(fd);
+    if (data == MAP_FAILED) {
+      perror("mmap");
+      return -1;
+    }
+    madvise(data, size, MADV_SEQUENTIAL);
+    int ret = map_buffer(table, data + (offset - start), (size_t)length);
+    munmap(data, size);
+    return ret;
+  }
+
+  // pipes and other non-regular files cannot be mapped, stream the
+  // already open descriptor so nothing written to it is lost
+  if (offset > 0 && lseek(fd, offset, SEEK_SET) < 0) {
+    perror("lseek");
+    close(fd);
+    return -1;
+  }
+  FILE *fp = fdopen(fd, "r");
+  if (!fp) {
+    perror("fdopen");
+    close(fd);
+    return -1;
+  }
+  int ret = map_stream(table, fp, length);
+  fclose(fp);
+  return ret;
+}
+
+// Split a `file:offset:length` argument in place.
+// Return 1 and fill in offset and length if arg names a chunk,
+// 0 if it is a plain file path
+static int parse_chunk(char *arg, off_t *offset, off_t *length) {
+  char *len_sep = strrchr(arg, ':');
+  if (len_sep == NULL || len_sep == arg) {
+    return 0;
+  }
+  *len_sep = '\0';
+  char *off_sep = strrchr(arg, ':');
+  *len_sep = ':';
+  if (off_sep == NULL || off_sep == arg) {
+    return 0;
+  }
+
+  char *end;
+  long long off = strtoll(off_sep + 1, &end, 10);
+  if (end != len_sep || off < 0) {
+    return 0;
+  }
+  long long len = strtoll(len_sep + 1, &end, 10);
+  if (*end != '\0' || end == len_sep + 1 || len < 0) {
+    return 0;
+  }
+
+  *off_sep = '\0';
+  *offset = off;
+  *length = len;
+  return 1;
+}
+
+int map_input(table_t *table, char *arg, int use_mmap) {
+  off_t offset, length;
+  if (parse_chunk(arg, &offset, &length)) {
+    return map_chunk(table, arg, offset, length, use_mmap);
+  }
+  return use_mmap ? map_log_mmap(table, arg) : map_log(table, arg);
+}
@@ -3,46 +3,144 @@
 #include <ctype.h>
 #include <dirent.h>
 #include <fcntl.h>
+#include <getopt.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
 #include <sys/stat.h>
 #include <unistd.h>
 
+#include "./include/group.h"
+#include "./include/stats.h"
 #include "./include/table.h"
+#include "./include/topk.h"
+
+// Records reduce_file has added up, for --stats
+static size_t records_read;
+
+static int reduce_dir(const char *dir_name, const char *outfile,
+                      uint64_t start, uint64_t end);
 
 int main(int argc, char *argv[]) {
-  if (argc != 5) {
+  int merge = 0;
+  int group = 0;
+  int aggregates = 0;
+  size_t topk_cap = 0;
+  int *pipe_fds = NULL;
+  int n_pipes = 0;
+  int manifest_fd = -1;
+  const char *stats_file = NULL;
+  stats_t stats;
+  stats_start(&stats);
+  static struct option long_options[] = {
+      {"merge", no_argument, NULL, 'm'},
+      {"pipes", required_argument, NULL, 'p'},
+      {"manifest", required_argument, NULL, 'f'},
+      {"stats", required_argument, NULL, 's'},
+      {"group", no_argument, NULL, 'g'},
+      {"aggregates", no_argument, NULL, 'a'},
+      {"top-k", required_argument, NULL, 'k'},
+      {NULL, 0, NULL, 0},
+  };
+  int opt;
+  while ((opt = getopt_long(argc, argv, "+", long_options, NULL)) != -1) {
+    if (opt == 'm') {
+      merge = 1;
+    } else if (opt == 'g') {
+      group = 1;
+    } else if (opt == 'a') {
+      aggregates = 1;
+    } else if (opt == 'p' && !pipe_fds &&
+               (n_pipes = parse_fd_list(optarg, &pipe_fds)) > 0) {
+      // records come from mappers through pipe_fds, not a directory
+    } else if (opt == 'f' && parse_fd(optarg, &manifest_fd) == 0) {
+      // table paths are read from manifest_fd as the mappers finish
+    } else if (opt == 's') {
+      stats_file = optarg;
+    } else if (opt == 'k' && parse_count(optarg, &topk_cap) == 0) {
+      // summaries of topk_cap counters are merged
+    } else {
+      printf("Usage: reduce <read dir> <out file> <start ip> <end ip>\n");
+      return 1;
+    }
+  }
+
+  int no_dir = pipe_fds || manifest_fd >= 0;
+  if (argc - optind != (no_dir ? 3 : 4) || ((group || topk_cap > 0) && no_dir) ||
+      (aggregates && !group)) {
     printf("Usage: reduce <read dir> <out file> <start ip> <end ip>\n");
+    free(pipe_fds);
     return 1;
   }
 
-  char *dir_name = argv[1];
-  char *outfile = argv[2];
-  char *start_str = argv[3];
-  char *end_str = argv[4];
+  int arg = optind;
+  char *dir_name = no_dir ? NULL : argv[arg++];
+  char *outfile = argv[arg++];
+  char *start_str = argv[arg++];
+  char *end_str = argv[arg++];
 
-  if (start_str[0] == '\0' || end_str[0] == '\0') {
+  uint64_t start, end;
+  if (parse_bound(start_str, &start) != 0 || parse_bound(end_str, &end) != 0) {
     printf("reduce: invalid IP range\n");
     return 1;
   }
 
-  for (int i = 0; start_str[i] != '\0'; i++) {
-    if (!isdigit(start_str[i])) {
-      printf("reduce: invalid IP range\n");
-      return 1;
-    }
+  int ret;
+  if (pipe_fds) {
+    ret = reduce_pipes(pipe_fds, n_pipes, outfile, start, end, &records_read);
+    free(pipe_fds);
+  } else if (manifest_fd >= 0) {
+    ret = reduce_manifest(manifest_fd, outfile, start, end);
+  } else if (topk_cap > 0) {
+    ret = reduce_topk(dir_name, outfile, start, end, topk_cap, &records_read);
+  } else if (group) {
+    ret = reduce_group(dir_name, outfile, start, end, aggregates,
+                       &records_read);
+  } else if (merge) {
+    ret = reduce_merge(dir_name, outfile, start, end, &records_read);
+  } else {
+    ret = reduce_dir(dir_name, outfile, start, end);
   }
 
-  for (int i = 0; end_str[i] != '\0'; i++) {
-    if (!isdigit(end_str[i])) {
-      printf("reduce: invalid IP range\n");
-      return 1;
+  if (ret == 0 && stats_file) {
+    struct stat st;
+    if (stat(outfile, &st) == 0) {
+      stats.bytes_written = st.st_size;
+      size_t record_size = group ? group_record_size(aggregates)
+                           : topk_cap > 0 ? sizeof(topk_entry_t)
+                                          : sizeof(record_t);
+      size_t keys;
+      if (table_file_count(outfile, &keys) == 0) {
+        stats.keys = keys;
+      }
+      stats.bytes_read = records_read * record_size;
     }
+    stats_stop(&stats, 0);
+    if (stats_write(stats_file, &stats) != 0)
+      return 1;
+  }
+  return ret;
+}
+
+// Join dir_name and the name of one of its files into path
+//
+// Return 0 on success, -1 if the path does not fit in MAX_PATH
+static int join_path(char path[MAX_PATH], const char *dir_name,
+                     const char *name) {
+  int len = snprintf(path, MAX_PATH, "%s/%s", dir_name, name);
+  if (len < 0 || len >= MAX_PATH) {
+    fprintf(stderr, "reduce: path too long: %s/%s\n", dir_name, name);
+    return -1;
   }
+  return 0;
+}
 
-  int start = atoi(start_str);
-  int end = atoi(end_str);
+// Add up the range of every table file in dir_name in a hash table and
+// write it to out_file
+//
+// Return 0 on success, 1 on failure
+static int reduce_dir(const char *dir_name, const char *outfile,
+                      uint64_t start, uint64_t end) {
   table_t *table = table_init();
 
   if (table == NULL) {
@@ -65,9 +163,9 @@ int main(int argc, char *argv[]) {
     }
 
     char path[MAX_PATH];
-    snprintf(path, MAX_PATH, "%s/%s", dir_name, file->d_name);
 
-    if (reduce_file(table, path, start, end) != 0) {
+    if (join_path(path, dir_name, file->d_name) != 0 ||
+        reduce_file(table, path, start, end) != 0) {
       closedir(dir);
       table_free(table);
       return 1;
@@ -85,48 +183,285 @@ int main(int argc, char *argv[]) {
   return 0;
 }
 
-int reduce_file(table_t *table, const char file_path[MAX_PATH], const int start,
-                const int end) {
-  table_t *temp = table_from_file(file_path);
+int parse_bound(const char *bound, uint64_t *key) {
+  if (bound[0] == '\0') {
+    return -1;
+  }
+  if (strchr(bound, '.') != NULL) {
+    uint32_t ip;
+    if (ip_to_key(bound, &ip) != 0) {
+      return -1;
+    }
+    *key = ip;
+    return 0;
+  }
+  for (int i = 0; bound[i] != '\0'; i++) {
+    if (!isdigit(bound[i])) {
+      return -1;
+    }
+  }
+  uint64_t octet = strtoull(bound, NULL, 10);
+  *key = octet < 256 ? octet << 24 : KEY_SPACE;
+  return 0;
+}
 
-  if (temp == NULL) {
+int reduce_file(table_t *table, const char file_path[MAX_PATH],
+                const uint64_t start, const uint64_t end) {
+  table_view_t *view = table_view_open(file_path);
+
+  if (view == NULL ||
+      table_view_verify_range(view, start, end, file_path) != 0) {
+    table_view_close(view);
     return 1;
   }
 
-  for (int i = 0; i < TABLE_LEN; i++) {
-    bucket_t *bucket = temp->buckets[i];
+  size_t count;
+  const record_t *records = table_view_range(view, start, end, &count);
+  records_read += count;
 
-    while (bucket != NULL) {
-      int byte = atoi(bucket->ip);
+  for (size_t i = 0; i < count; i++) {
+    bucket_t *match = table_get_key(table, records[i].key);
 
-      if (byte >= start && byte < end) {
-        bucket_t *match = table_get(table, bucket->ip);
+    if (match != NULL) {
+      match->requests += records[i].requests;
 
-        if (match != NULL) {
-          match->requests += bucket->requests;
+    } else {
+      bucket_t *new_bucket = table_add_key(table, records[i].key);
 
-        } else {
-          bucket_t *new_bucket = bucket_init(bucket->ip);
+      if (new_bucket == NULL) {
+        table_view_close(view);
+        return 1;
+      }
 
-          if (new_bucket == NULL) {
-            table_free(temp);
-            return 1;
-          }
+      new_bucket->requests = records[i].requests;
+    }
+  }
+
+  table_view_close(view);
+  return 0;
+}
 
-          new_bucket->requests = bucket->requests;
+int reduce_merge(const char dir_name[MAX_PATH], const char out_file[MAX_PATH],
+                 const uint64_t start, const uint64_t end, size_t *n_read) {
+  DIR *dir = opendir(dir_name);
+  if (dir == NULL) {
+    perror("opendir");
+    return 1;
+  }
 
-          if (table_add(table, new_bucket) != 0) {
-            free(new_bucket);
-            table_free(temp);
-            return 1;
-          }
-        }
+  char (*paths)[MAX_PATH] = NULL;
+  size_t n = 0, cap = 0;
+  struct dirent *file;
+  while ((file = readdir(dir)) != NULL) {
+    if (strcmp(file->d_name, ".") == 0 || strcmp(file->d_name, "..") == 0) {
+      continue;
+    }
+    if (n == cap) {
+      cap = cap ? cap * 2 : 16;
+      char (*grown)[MAX_PATH] = realloc(paths, cap * sizeof(*paths));
+      if (grown == NULL) {
+        closedir(dir);
+        free(paths);
+        return 1;
       }
+      paths = grown;
+    }
+    if (join_path(paths[n++], dir_name, file->d_name) != 0) {
+      closedir(dir);
+      free(paths);
+      return 1;
+    }
+  }
+  closedir(dir);
 
-      bucket = bucket->next;
+  const char **in_files = malloc((n ? n : 1) * sizeof(char *));
+  if (in_files == NULL) {
+    free(paths);
+    return 1;
+  }
+  for (size_t i = 0; i < n; i++) {
+    in_files[i] = paths[i];
+  }
+  int ret = table_merge(in_files, n, start, end, out_file, n_read);
+  free(in_files);
+  free(paths);
+  return ret != 0;
+}
+
+int reduce_pipes(const int fds[], int n_fds, const char out_file[MAX_PATH],
+                 const uint64_t start, const uint64_t end, size_t *n_read) {
+  table_run_t **runs = malloc(n_fds * sizeof(table_run_t *));
+  if (runs == NULL) {
+    return 1;
+  }
+  for (int i = 0; i < n_fds; i++) {
+    runs[i] = table_run_fdopen(fds[i], start, end);
+    if (runs[i] == NULL) {
+      for (int j = 0; j < i; j++) {
+        table_run_close(runs[j]);
+      }
+      free(runs);
+      return 1;
     }
   }
+  int ret = table_merge_runs(runs, n_fds, out_file, n_read);
+  free(runs);
+  return ret != 0;
+}
 
-  table_free(temp);
-  return 0;
+int reduce_manifest(int fd, const char out_file[MAX_PATH],
+                    const uint64_t start, const uint64_t end) {
+  FILE *manifest = fdopen(fd, "r");
+  if (manifest == NULL) {
+    perror("fdopen");
+    return 1;
+  }
+
+  table_t *table = table_init();
+  if (table == NULL) {
+    fclose(manifest);
+    return 1;
+  }
+
+  char path[MAX_PATH + 1];
+  while (fgets(path, sizeof(path), manifest)) {
+    path[strcspn(path, "\n")] = '\0';
+    if (reduce_file(table, path, start, end) != 0) {
+      fclose(manifest);
+      table_free(table);
+      return 1;
+    }
+  }
+  fclose(manifest);
+
+  int ret = table_to_file(table, out_file);
+  table_free(table);
+  return ret != 0;
+}
+
+int reduce_group(const char dir_name[MAX_PATH], const char out_file[MAX_PATH],
+                 const uint64_t start, const uint64_t end, int metrics,
+                 size_t *n_read) {
+  group_table_t *table = group_table_init(metrics);
+  if (table == NULL) {
+    return 1;
+  }
+  DIR *dir = opendir(dir_name);
+  if (dir == NULL) {
+    perror("opendir");
+    group_table_free(table);
+    return 1;
+  }
+
+  size_t total = 0;
+  struct dirent *file;
+  while ((file = readdir(dir)) != NULL) {
+    if (strcmp(file->d_name, ".") == 0 || strcmp(file->d_name, "..") == 0) {
+      continue;
+    }
+    char path[MAX_PATH];
+    size_t count;
+    void *records = NULL;
+    if (join_path(path, dir_name, file->d_name) == 0) {
+      records = group_read_range(path, start, end, metrics, &count);
+    }
+    if (records == NULL) {
+      closedir(dir);
+      group_table_free(table);
+      return 1;
+    }
+    for (size_t i = 0; i < count; i++) {
+      const group_record_t *record = group_record_at(records, i, metrics);
+      const aggregate_t *agg =
+          metrics ? &((const aggregate_record_t *)record)->agg : NULL;
+      if (group_table_add(table, record->key, record->requests, agg) != 0) {
+        free(records);
+        closedir(dir);
+        group_table_free(table);
+        return 1;
+      }
+    }
+    total += count;
+    free(records);
+  }
+  closedir(dir);
+
+  if (n_read != NULL) {
+    *n_read = total;
+  }
+  int ret = group_to_file(table, out_file);
+  group_table_free(table);
+  return ret != 0;
+}
+
+int reduce_topk(const char dir_name[MAX_PATH], const char out_file[MAX_PATH],
+                const uint64_t start, const uint64_t end, size_t capacity,
+                size_t *n_read) {
+  DIR *dir = opendir(dir_name);
+  if (dir == NULL) {
+    perror("opendir");
+    return 1;
+  }
+
+  // summaries are small, so every one is read before merging them all
+  topk_entry_t **summaries = NULL;
+  size_t *counts = NULL;
+  uint32_t *floors = NULL;
+  size_t n = 0, cap = 0;
+  size_t total = 0;
+  int ret = 0;
+  struct dirent *file;
+  while ((file = readdir(dir)) != NULL) {
+    if (strcmp(file->d_name, ".") == 0 || strcmp(file->d_name, "..") == 0) {
+      continue;
+    }
+    if (n == cap) {
+      cap = cap ? cap * 2 : 16;
+      topk_entry_t **s = realloc(summaries, cap * sizeof(*summaries));
+      if (s != NULL)
+        summaries = s;
+      size_t *c = realloc(counts, cap * sizeof(*counts));
+      if (c != NULL)
+        counts = c;
+      uint32_t *f = realloc(floors, cap * sizeof(*floors));
+      if (f != NULL)
+        floors = f;
+      if (s == NULL || c == NULL || f == NULL) {
+        fprintf(stderr, "malloc failed\n");
+        ret = 1;
+        break;
+      }
+    }
+    char path[MAX_PATH];
+    if (join_path(path, dir_name, file->d_name) != 0) {
+      ret = 1;
+      break;
+    }
+    summaries[n] = topk_read_range(path, start, end, &counts[n], &floors[n]);
+    if (summaries[n] == NULL) {
+      ret = 1;
+      break;
+    }
+    total += counts[n++];
+  }
+  closedir(dir);
+
+  if (ret == 0) {
+    size_t count;
+    uint32_t floor;
+    topk_entry_t *merged =
+        topk_merge(summaries, counts, floors, n, capacity, &count, &floor);
+    ret = merged == NULL || topk_write(out_file, merged, count, floor) != 0;
+    free(merged);
+  }
+  for (size_t i = 0; i < n; i++) {
+    free(summaries[i]);
+  }
+  free(summaries);
+  free(counts);
+  free(floors);
+  if (n_read != NULL) {
+    *n_read = total;
+  }
+  return ret;
 }
@@ -0,0 +1,84 @@
+#include "./include/stats.h"
+
+#include <string.h>
+#include <sys/resource.h>
+#include <time.h>
+
+double stats_now(void) {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+void stats_start(stats_t *stats) {
+  memset(stats, 0, sizeof(*stats));
+  stats->start = stats_now();
+}
+
+static double tv_sec(struct timeval tv) {
+  return tv.tv_sec + tv.tv_usec / 1e6;
+}
+
+void stats_stop(stats_t *stats, int with_children) {
+  stats->wall_sec = stats_now() - stats->start;
+
+  struct rusage usage;
+  getrusage(RUSAGE_SELF, &usage);
+  stats->cpu_sec = tv_sec(usage.ru_utime) + tv_sec(usage.ru_stime);
+  stats->peak_rss_kb = usage.ru_maxrss;
+
+  if (with_children) {
+    getrusage(RUSAGE_CHILDREN, &usage);
+    stats->cpu_sec += tv_sec(usage.ru_utime) + tv_sec(usage.ru_stime);
+    if (usage.ru_maxrss > stats->peak_rss_kb)
+      stats->peak_rss_kb = usage.ru_maxrss;
+  }
+}
+
+void stats_print(FILE *fp, const stats_t *stats) {
+  fprintf(fp,
+          "{\"wall_sec\": %.6f, \"cpu_sec\": %.6f, \"lines\": %lld, "
+          "\"rejected\": %lld, \"bytes_read\": %lld, \"bytes_written\": %lld, "
+          "\"keys\": %lld, \"peak_rss_kb\": %ld}",
+          stats->wall_sec, stats->cpu_sec, stats->lines, stats->rejected,
+          stats->bytes_read, stats->bytes_written, stats->keys,
+          stats->peak_rss_kb);
+}
+
+int stats_write(const char *path, const stats_t *stats) {
+  FILE *fp = fopen(path, "w");
+  if (fp == NULL) {
+    perror("fopen");
+    return -1;
+  }
+  stats_print(fp, stats);
+  fputc('\n', fp);
+  if (fclose(fp) != 0) {
+    perror("fclose");
+    return -1;
+  }
+  return 0;
+}
+
+int stats_read(const char *path, stats_t *stats) {
+  FILE *fp = fopen(path, "r");
+  if (fp == NULL) {
+    perror("fopen");
+    return -1;
+  }
+  memset(stats, 0, sizeof(*stats));
+  int n = fscanf(fp,
+                 "{\"wall_sec\": %lf, \"cpu_sec\": %lf, \"lines\": %lld, "
+                 "\"rejected\": %lld, \"bytes_read\": %lld, "
+                 "\"bytes_written\": %lld, \"keys\": %lld, "
+                 "\"peak_rss_kb\": %ld}",
+                 &stats->wall_sec, &stats->cpu_sec, &stats->lines,
+                 &stats->rejected, &stats->bytes_read, &stats->bytes_written,
+                 &stats->keys, &stats->peak_rss_kb);
+  fclose(fp);
+  if (n != 8) {
+    fprintf(stderr, "stats: malformed report %s\n", path);
+    return -1;
+  }
+  return 0;
+}
@@ -1,27 +1,98 @@
+#include <fcntl.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
 
 #include "./include/map.h"
 
-bucket_t *bucket_init(const char ip[IP_LEN]) {
+int ip_to_key_n(const char *ip, size_t len, uint32_t *key) {
+  if (ip == NULL || key == NULL) {
+    return -1;
+  }
+  const char *end = ip + len;
+  uint32_t packed = 0;
+  for (int octet = 0; octet < 4; octet++) {
+    if (octet > 0 && (ip == end || *ip++ != '.')) {
+      return -1;
+    }
+    int digits = 0;
+    uint32_t value = 0;
+    while (ip < end && *ip >= '0' && *ip <= '9' && digits < 3) {
+      value = value * 10 + (uint32_t)(*ip++ - '0');
+      digits++;
+    }
+    if (digits == 0 || value > 255) {
+      return -1;
+    }
+    packed = (packed << 8) | value;
+  }
+  if (ip != end) {
+    return -1;
+  }
+  *key = packed;
+  return 0;
+}
+
+int ip_to_key(const char *ip, uint32_t *key) {
   if (ip == NULL) {
-    return NULL;
+    return -1;
   }
+  return ip_to_key_n(ip, strlen(ip), key);
+}
 
+void key_to_ip(uint32_t key, char ip[IP_LEN]) {
+  char *p = ip;
+  for (int shift = 24; shift >= 0; shift -= 8) {
+    unsigned int octet = (key >> shift) & 0xff;
+    if (octet >= 100) {
+      *p++ = (char)('0' + octet / 100);
+    }
+    if (octet >= 10) {
+      *p++ = (char)('0' + octet / 10 % 10);
+    }
+    *p++ = (char)('0' + octet % 10);
+    *p++ = shift > 0 ? '.' : '\0';
+  }
+}
+
+bucket_t *bucket_init_key(uint32_t key) {
   bucket_t *bucket = malloc(sizeof(bucket_t));
   if (bucket == NULL) {
     return NULL;
   }
-  memset(bucket, 0, sizeof(bucket_t));
-  strncpy(bucket->ip, ip, IP_LEN - 1);
-  bucket->ip[IP_LEN - 1] = '\0';
+  bucket->key = key;
   bucket->requests = 0;
-  bucket->next = NULL;
   return bucket;
 }
+
+bucket_t *bucket_init(const char ip[IP_LEN]) {
+  uint32_t key;
+  if (ip_to_key(ip, &key) != 0) {
+    return NULL;
+  }
+  return bucket_init_key(key);
+}
 table_t *table_init() {
   table_t *table = calloc(1, sizeof(table_t));
+  if (table == NULL) {
+    return NULL;
+  }
+  table->slots = malloc(TABLE_INIT_CAP * sizeof(slot_t));
+  table->buckets = malloc(TABLE_INIT_CAP * sizeof(bucket_t *));
+  if (table->slots == NULL || table->buckets == NULL) {
+    free(table->slots);
+    free(table->buckets);
+    free(table);
+    return NULL;
+  }
+  for (size_t i = 0; i < TABLE_INIT_CAP; i++) {
+    table->slots[i].idx = -1;
+  }
+  table->capacity = TABLE_INIT_CAP;
+  table->count = 0;
   return table;
 }
 
@@ -30,138 +101,1307 @@ void table_print(const table_t *table) {
     return;
   }
 
-  for (int i = 0; i < TABLE_LEN; i++) {
-    bucket_t *curr = table->buckets[i];
-    while (curr != NULL) {
-      printf("%s - %d\n", curr->ip, curr->requests);
-      curr = curr->next;
-    }
+  char ip[IP_LEN];
+  for (size_t i = 0; i < table->count; i++) {
+    key_to_ip(table->buckets[i]->key, ip);
+    printf("%s - %d\n", ip, table->buckets[i]->requests);
   }
 }
 void table_free(table_t *table) {
   if (table == NULL) {
     return;
   }
-  for (int i = 0; i < TABLE_LEN; i++) {
-    bucket_t *curr = table->buckets[i];
-    while (curr != NULL) {
-      bucket_t *next = curr->next;
-      free(curr);
-      curr = next;
-    }
-    table->buckets[i] = NULL;
+  for (size_t i = 0; i < table->n_external; i++) {
+    free(table->external[i]);
   }
+  slab_t *slab = table->slabs;
+  while (slab != NULL) {
+    slab_t *next = slab->next;
+    free(slab);
+    slab = next;
+  }
+  free(table->external);
+  free(table->buckets);
+  free(table->slots);
   free(table);
 }
+
+void table_clear(table_t *table) {
+  if (table == NULL) {
+    return;
+  }
+  for (size_t i = 0; i < table->n_external; i++) {
+    free(table->external[i]);
+  }
+  table->n_external = 0;
+  // keep the newest, largest slab for the buckets still to come
+  slab_t *slab = table->slabs;
+  if (slab != NULL) {
+    slab_t *older = slab->next;
+    while (older != NULL) {
+      slab_t *next = older->next;
+      free(older);
+      older = next;
+    }
+    slab->next = NULL;
+    slab->used = 0;
+  }
+  for (size_t i = 0; i < table->capacity; i++) {
+    table->slots[i].idx = -1;
+  }
+  table->count = 0;
+}
+
+// Double the slot array and reinsert every key.
+// buckets only needs to hold as many entries as the load factor allows,
+// so it is resized alongside the slots.
+static int table_grow(table_t *table) {
+  size_t capacity = table->capacity * 2;
+  slot_t *slots = malloc(capacity * sizeof(slot_t));
+  if (slots == NULL) {
+    return -1;
+  }
+  bucket_t **buckets = realloc(table->buckets, capacity * sizeof(bucket_t *));
+  if (buckets == NULL) {
+    free(slots);
+    return -1;
+  }
+  for (size_t i = 0; i < capacity; i++) {
+    slots[i].idx = -1;
+  }
+  size_t mask = capacity - 1;
+  for (size_t i = 0; i < table->capacity; i++) {
+    slot_t old = table->slots[i];
+    if (old.idx < 0) {
+      continue;
+    }
+    size_t pos = hash_key(old.key) & mask;
+    while (slots[pos].idx >= 0) {
+      pos = (pos + 1) & mask;
+    }
+    slots[pos] = old;
+  }
+  free(table->slots);
+  table->slots = slots;
+  table->buckets = buckets;
+  table->capacity = capacity;
+  return 0;
+}
+
+// Grow the table until count buckets fit without another resize
+static int table_reserve(table_t *table, size_t count) {
+  while (count * TABLE_LOAD_DEN > table->capacity * TABLE_LOAD_NUM) {
+    if (table_grow(table) != 0) {
+      return -1;
+    }
+  }
+  return 0;
+}
+
+// Index a bucket that the table already owns
+static int table_insert(table_t *table, bucket_t *bucket) {
+  if ((table->count + 1) * TABLE_LOAD_DEN > table->capacity * TABLE_LOAD_NUM &&
+      table_grow(table) != 0) {
+    return -1;
+  }
+  size_t mask = table->capacity - 1;
+  size_t pos = hash_key(bucket->key) & mask;
+  while (table->slots[pos].idx >= 0) {
+    pos = (pos + 1) & mask;
+  }
+  table->slots[pos].key = bucket->key;
+  table->slots[pos].idx = (int32_t)table->count;
+  table->buckets[table->count++] = bucket;
+  return 0;
+}
+
 int table_add(table_t *table, bucket_t *bucket) {
-  if (table == NULL || bucket == NULL || bucket->ip[0] == '\0') {
+  if (table == NULL || bucket == NULL) {
     return -1;
   }
-  int idx = hash_ip(bucket->ip);
-  if (idx < 0 || idx >= TABLE_LEN) {
+  // make room first so that a bucket in the table is always recorded
+  if (table->n_external == table->cap_external) {
+    size_t cap = table->cap_external ? table->cap_external * 2 : TABLE_INIT_CAP;
+    bucket_t **external = realloc(table->external, cap * sizeof(bucket_t *));
+    if (external == NULL) {
+      return -1;
+    }
+    table->external = external;
+    table->cap_external = cap;
+  }
+  if (table_insert(table, bucket) != 0) {
     return -1;
   }
-  bucket->next = table->buckets[idx];
-  table->buckets[idx] = bucket;
+  table->external[table->n_external++] = bucket;
   return 0;
 }
-bucket_t *table_get(table_t *table, const char ip[IP_LEN]) {
-  if (table == NULL || ip == NULL) {
+
+bucket_t *table_add_key(table_t *table, uint32_t key) {
+  if (table == NULL) {
     return NULL;
   }
-  int idx = hash_ip(ip);
-  if (idx < 0 || idx >= TABLE_LEN) {
+  slab_t *slab = table->slabs;
+  if (slab == NULL || slab->used == slab->cap) {
+    size_t cap = slab ? slab->cap * 2 : TABLE_SLAB_MIN;
+    if (cap > TABLE_SLAB_MAX) {
+      cap = TABLE_SLAB_MAX;
+    }
+    slab = malloc(sizeof(slab_t) + cap * sizeof(bucket_t));
+    if (slab == NULL) {
+      return NULL;
+    }
+    slab->next = table->slabs;
+    slab->used = 0;
+    slab->cap = cap;
+    table->slabs = slab;
+  }
+  bucket_t *bucket = &slab->buckets[slab->used++];
+  bucket->key = key;
+  bucket->requests = 0;
+  if (table_insert(table, bucket) != 0) {
+    slab->used--;
+    return NULL;
+  }
+  return bucket;
+}
+
+bucket_t *table_get_key(table_t *table, uint32_t key) {
+  if (table == NULL) {
     return NULL;
   }
-  bucket_t *curr = table->buckets[idx];
-  while (curr != NULL) {
-    if (strcmp(curr->ip, ip) == 0) {
-      return curr;
+  size_t mask = table->capacity - 1;
+  size_t pos = hash_key(key) & mask;
+  while (table->slots[pos].idx >= 0) {
+    if (table->slots[pos].key == key) {
+      return table->buckets[table->slots[pos].idx];
     }
-    curr = curr->next;
+    pos = (pos + 1) & mask;
   }
   return NULL;
 }
+bucket_t *table_get(table_t *table, const char ip[IP_LEN]) {
+  uint32_t key;
+  if (table == NULL || ip_to_key(ip, &key) != 0) {
+    return NULL;
+  }
+  return table_get_key(table, key);
+}
+uint32_t hash_key(uint32_t key) {
+  // murmur3 fmix32 finalizer, every input bit affects every output bit
+  // so the low bits used by the slot mask are well distributed even for
+  // runs of neighbouring addresses. It is a bijection on 32 bits, so two
+  // distinct keys never share a full hash.
+  key ^= key >> 16;
+  key *= 0x85ebca6bu;
+  key ^= key >> 13;
+  key *= 0xc2b2ae35u;
+  key ^= key >> 16;
+  return key;
+}
 int hash_ip(const char ip[IP_LEN]) {
-  if (ip == NULL) {
+  uint32_t key;
+  if (ip_to_key(ip, &key) != 0) {
     return -1;
   }
-  int sum = 0;
-  for (int i = 0; i < IP_LEN && ip[i] != '\0'; i++) {
-    sum += (unsigned char)ip[i];
+  return (int)(hash_key(key) & 0x7fffffff);
+}
+void records_sort(record_t *records, size_t count) {
+  if (count < 2) {
+    return;
   }
-  if (TABLE_LEN <= 0) {
-    return -1;
+  record_t *tmp = malloc(count * sizeof(record_t));
+  if (tmp == NULL) {
+    // fall back to an insertion sort rather than failing the write
+    for (size_t i = 1; i < count; i++) {
+      record_t r = records[i];
+      size_t j = i;
+      while (j > 0 && records[j - 1].key > r.key) {
+        records[j] = records[j - 1];
+        j--;
+      }
+      records[j] = r;
+    }
+    return;
   }
-  return sum % TABLE_LEN;
+  record_t *src = records, *dst = tmp;
+  for (int shift = 0; shift < 32; shift += 8) {
+    size_t offsets[257] = {0};
+    for (size_t i = 0; i < count; i++) {
+      offsets[((src[i].key >> shift) & 0xff) + 1]++;
+    }
+    // every key shares this byte, the pass would not move anything
+    if (offsets[((src[0].key >> shift) & 0xff) + 1] == count) {
+      continue;
+    }
+    for (int b = 0; b < 256; b++) {
+      offsets[b + 1] += offsets[b];
+    }
+    for (size_t i = 0; i < count; i++) {
+      dst[offsets[(src[i].key >> shift) & 0xff]++] = src[i];
+    }
+    record_t *swap = src;
+    src = dst;
+    dst = swap;
+  }
+  if (src != records) {
+    memcpy(records, src, count * sizeof(record_t));
+  }
+  free(tmp);
 }
-int table_to_file(table_t *table, const char out_file[MAX_PATH]) {
-  if (table == NULL || out_file == NULL) {
+
+uint32_t table_checksum(uint32_t hash, const void *data, size_t len) {
+  const unsigned char *bytes = data;
+  for (size_t i = 0; i < len; i++) {
+    hash ^= bytes[i];
+    hash *= 16777619u;
+  }
+  return hash;
+}
+
+// Continue the FNV-1a hash of the records before with n more records
+static uint32_t records_checksum(uint32_t hash, const record_t *records,
+                                 size_t n) {
+  return table_checksum(hash, records, n * sizeof(record_t));
+}
+
+void table_header_init(table_header_t *header, uint16_t key_encoding) {
+  memset(header, 0, sizeof(*header));
+  header->magic = TABLE_MAGIC;
+  header->version = TABLE_VERSION;
+  header->key_encoding = key_encoding;
+  header->checksum = TABLE_CHECKSUM_INIT;
+}
+
+uint64_t table_file_size(size_t count, size_t size) {
+  return sizeof(table_header_t) + (uint64_t)count * size +
+         TABLE_FENCES(count) * sizeof(table_fence_t);
+}
+
+// Return the key or hash at the start of a record of any key encoding
+static uint32_t record_key(const void *record) {
+  uint32_t key;
+  memcpy(&key, record, sizeof(key));
+  return key;
+}
+
+// Count a record of size bytes in header and in the fence of its block.
+// Records must be added in the order they are written.
+static void header_add(table_header_t *header, table_fence_t *fence,
+                       const void *record, size_t size) {
+  if (header->count % TABLE_FENCE_LEN == 0) {
+    fence->key = record_key(record);
+    fence->checksum = TABLE_CHECKSUM_INIT;
+  }
+  fence->checksum = table_checksum(fence->checksum, record, size);
+  header->checksum = table_checksum(header->checksum, record, size);
+  header->index[(record_key(record) >> 24) + 1]++;
+  header->count++;
+}
+
+// Turn the per octet counts of header into the index, once every record
+// has been added
+static void header_finish(table_header_t *header) {
+  for (int o = 0; o < TABLE_INDEX_LEN; o++) {
+    header->index[o + 1] += header->index[o];
+  }
+}
+
+int table_write(const char out_file[MAX_PATH], table_header_t *header,
+                const void *records, size_t count, size_t size) {
+  if (out_file == NULL || header == NULL || (records == NULL && count > 0)) {
+    return -1;
+  }
+  size_t n_fences = TABLE_FENCES(count);
+  table_fence_t *fences =
+      malloc((n_fences ? n_fences : 1) * sizeof(table_fence_t));
+  if (fences == NULL) {
     return -1;
   }
+  const char *bytes = records;
+  for (size_t i = 0; i < count; i++) {
+    header_add(header, &fences[i / TABLE_FENCE_LEN], bytes + i * size, size);
+  }
+  header_finish(header);
+
   FILE *fp = fopen(out_file, "wb");
   if (fp == NULL) {
     perror("fopen");
+    free(fences);
     return -1;
   }
-  for (int i = 0; i < TABLE_LEN; i++) {
-    bucket_t *curr = table->buckets[i];
-    while (curr != NULL) {
-      if (fwrite(curr, sizeof(bucket_t), 1, fp) != 1) {
-        perror("fwrite");
-        fclose(fp);
-        return -1;
-      }
-      curr = curr->next;
+  int ret = 0;
+  if (fwrite(header, sizeof(*header), 1, fp) != 1 ||
+      fwrite(records, size, count, fp) != count ||
+      fwrite(fences, sizeof(table_fence_t), n_fences, fp) != n_fences) {
+    perror("fwrite");
+    ret = -1;
+  }
+  free(fences);
+  if (fclose(fp) != 0 && ret == 0) {
+    perror("fclose");
+    ret = -1;
+  }
+  return ret;
+}
+
+struct table_writer {
+  FILE *fp;
+  table_header_t header;    // index holds per octet counts until close
+  table_fence_t *fences;    // written after the records on close
+  size_t cap_fences;
+  int64_t last_key;         // -1 before the first record
+};
+
+table_writer_t *table_writer_open(const char out_file[MAX_PATH]) {
+  if (out_file == NULL) {
+    return NULL;
+  }
+  table_writer_t *writer = calloc(1, sizeof(table_writer_t));
+  if (writer == NULL) {
+    return NULL;
+  }
+  writer->fp = fopen(out_file, "wb");
+  if (writer->fp == NULL) {
+    perror("fopen");
+    free(writer);
+    return NULL;
+  }
+  table_header_init(&writer->header, TABLE_KEY_IPV4);
+  writer->last_key = -1;
+  // reserve room for the header, it is rewritten once the index is known
+  if (fwrite(&writer->header, sizeof(table_header_t), 1, writer->fp) != 1) {
+    perror("fwrite");
+    fclose(writer->fp);
+    free(writer);
+    return NULL;
+  }
+  return writer;
+}
+
+int table_writer_add(table_writer_t *writer, const record_t *record) {
+  if (writer == NULL || record == NULL) {
+    return -1;
+  }
+  if ((int64_t)record->key <= writer->last_key) {
+    fprintf(stderr, "table: records written out of order\n");
+    return -1;
+  }
+  size_t block = writer->header.count / TABLE_FENCE_LEN;
+  if (block == writer->cap_fences) {
+    size_t cap = writer->cap_fences ? 2 * writer->cap_fences : 16;
+    table_fence_t *fences =
+        realloc(writer->fences, cap * sizeof(table_fence_t));
+    if (fences == NULL) {
+      return -1;
     }
+    writer->fences = fences;
+    writer->cap_fences = cap;
   }
-  if (fclose(fp) != 0) {
+  if (fwrite(record, sizeof(record_t), 1, writer->fp) != 1) {
+    perror("fwrite");
+    return -1;
+  }
+  header_add(&writer->header, &writer->fences[block], record,
+             sizeof(record_t));
+  writer->last_key = record->key;
+  return 0;
+}
+
+int table_writer_close(table_writer_t *writer) {
+  if (writer == NULL) {
+    return -1;
+  }
+  table_header_t *header = &writer->header;
+  header_finish(header);
+  size_t n_fences = TABLE_FENCES(header->count);
+  int ret = 0;
+  if (fwrite(writer->fences, sizeof(table_fence_t), n_fences, writer->fp) !=
+          n_fences ||
+      fseek(writer->fp, 0, SEEK_SET) != 0 ||
+      fwrite(header, sizeof(table_header_t), 1, writer->fp) != 1) {
+    perror("fwrite");
+    ret = -1;
+  }
+  if (fclose(writer->fp) != 0) {
     perror("fclose");
+    ret = -1;
+  }
+  free(writer->fences);
+  free(writer);
+  return ret;
+}
+
+void table_writer_abort(table_writer_t *writer) {
+  if (writer == NULL) {
+    return;
+  }
+  fclose(writer->fp);
+  free(writer->fences);
+  free(writer);
+}
+
+int table_to_file(table_t *table, const char out_file[MAX_PATH]) {
+  if (table == NULL || out_file == NULL) {
+    return -1;
+  }
+
+  record_t *records = malloc(table->count ? table->count * sizeof(record_t) : 1);
+  if (records == NULL) {
+    return -1;
+  }
+  for (size_t i = 0; i < table->count; i++) {
+    records[i].key = table->buckets[i]->key;
+    records[i].requests = table->buckets[i]->requests;
+  }
+  records_sort(records, table->count);
+
+  table_writer_t *writer = table_writer_open(out_file);
+  if (writer == NULL) {
+    free(records);
+    return -1;
+  }
+  for (size_t i = 0; i < table->count; i++) {
+    if (table_writer_add(writer, &records[i]) != 0) {
+      table_writer_abort(writer);
+      free(records);
+      return -1;
+    }
+  }
+  free(records);
+  return table_writer_close(writer);
+}
+
+// Sanity check a header of a table of records of size bytes in the given
+// key encoding, and that a file of file_size bytes holds exactly the
+// records and fences it promises
+static int check_header(const table_header_t *header, const char *in_file,
+                        uint64_t file_size, uint16_t key_encoding,
+                        size_t size) {
+  if (header->magic != TABLE_MAGIC) {
+    fprintf(stderr, "table: %s is not a table file\n", in_file);
+    return -1;
+  }
+  if (header->version != TABLE_VERSION ||
+      header->key_encoding != key_encoding) {
+    fprintf(stderr, "table: %s has unsupported version %d key encoding %d\n",
+            in_file, header->version, header->key_encoding);
+    return -1;
+  }
+  if (header->index[0] != 0 ||
+      header->index[TABLE_INDEX_LEN] != header->count) {
+    fprintf(stderr, "table: corrupt header in %s\n", in_file);
+    return -1;
+  }
+  for (int o = 0; o < TABLE_INDEX_LEN; o++) {
+    if (header->index[o + 1] < header->index[o]) {
+      fprintf(stderr, "table: corrupt header in %s\n", in_file);
+      return -1;
+    }
+  }
+  if (file_size != table_file_size(header->count, size)) {
+    fprintf(stderr, "table: truncated file %s\n", in_file);
     return -1;
   }
   return 0;
 }
 
-table_t *table_from_file(const char in_file[MAX_PATH]) {
-  if (in_file == NULL) {
+// Read and sanity check the header at the start of fp
+static int read_header(FILE *fp, const char *in_file, table_header_t *header,
+                       uint16_t key_encoding, size_t size) {
+  if (fread(header, sizeof(*header), 1, fp) != 1) {
+    if (ferror(fp)) {
+      perror("fread");
+    } else {
+      fprintf(stderr, "table: missing header in %s\n", in_file);
+    }
+    return -1;
+  }
+  struct stat st;
+  if (fstat(fileno(fp), &st) != 0) {
+    perror("fstat");
+    return -1;
+  }
+  return check_header(header, in_file, (uint64_t)st.st_size, key_encoding,
+                      size);
+}
+
+// Read n items of size bytes at offset of fp into data
+static int read_at(FILE *fp, const char *in_file, uint64_t offset, void *data,
+                   size_t size, size_t n) {
+  if (fseek(fp, (long)offset, SEEK_SET) != 0) {
+    perror("fseek");
+    return -1;
+  }
+  if (fread(data, size, n, fp) != n) {
+    if (ferror(fp)) {
+      perror("fread");
+    } else {
+      fprintf(stderr, "table: truncated file %s\n", in_file);
+    }
+    return -1;
+  }
+  return 0;
+}
+
+// Offset of fence b in a table file of count records of size bytes
+static uint64_t fence_offset(size_t count, size_t size, size_t b) {
+  return sizeof(table_header_t) + (uint64_t)count * size +
+         (uint64_t)b * sizeof(table_fence_t);
+}
+
+// Find the fences [*lo, *hi) of the blocks that hold the records of the
+// octets covering [start, end), none if those octets are empty
+static void octet_fences(const table_header_t *header, uint64_t start,
+                         uint64_t end, size_t *lo, size_t *hi) {
+  *lo = *hi = 0;
+  if (start >= end) {
+    return;
+  }
+  size_t first = header->index[start >> 24];
+  size_t last = header->index[(end + 0xffffff) >> 24];
+  if (first < last) {
+    *lo = first / TABLE_FENCE_LEN;
+    *hi = TABLE_FENCES(last);
+  }
+}
+
+// Return the index of the first of n fences with a key >= key
+static size_t fences_lower_bound(const table_fence_t *fences, size_t n,
+                                 uint64_t key) {
+  size_t lo = 0, hi = n;
+  while (lo < hi) {
+    size_t mid = lo + (hi - lo) / 2;
+    if (fences[mid].key < key) {
+      lo = mid + 1;
+    } else {
+      hi = mid;
+    }
+  }
+  return lo;
+}
+
+// Narrow n consecutive fences down to the blocks [*b0, *b1) among them
+// that can hold keys in [start, end). The block before the first fence
+// >= start is included, since it may end with keys equal to start.
+static void fence_blocks(const table_fence_t *fences, size_t n,
+                         uint64_t start, uint64_t end, size_t *b0,
+                         size_t *b1) {
+  size_t first = fences_lower_bound(fences, n, start);
+  *b0 = first > 0 ? first - 1 : 0;
+  *b1 = start < end ? fences_lower_bound(fences, n, end) : *b0;
+  if (*b1 < *b0) {
+    *b1 = *b0;
+  }
+}
+
+// Check n blocks of records of size bytes, the first of which is block
+// first of a table of count records, against their fences
+static int check_blocks(const table_fence_t *fences, size_t first, size_t n,
+                        const void *records, size_t size, size_t count,
+                        const char *in_file) {
+  const unsigned char *bytes = records;
+  for (size_t b = 0; b < n; b++) {
+    size_t left = count - (first + b) * TABLE_FENCE_LEN;
+    size_t len = left < TABLE_FENCE_LEN ? left : TABLE_FENCE_LEN;
+    if (record_key(bytes) != fences[b].key ||
+        table_checksum(TABLE_CHECKSUM_INIT, bytes, len * size) !=
+            fences[b].checksum) {
+      fprintf(stderr, "table: checksum mismatch in %s\n", in_file);
+      return -1;
+    }
+    bytes += len * size;
+  }
+  return 0;
+}
+
+// Return the index of the first of n sorted records of size bytes with a
+// key >= key
+static size_t keys_lower_bound(const void *records, size_t n, size_t size,
+                               uint64_t key) {
+  const unsigned char *bytes = records;
+  size_t lo = 0, hi = n;
+  while (lo < hi) {
+    size_t mid = lo + (hi - lo) / 2;
+    if (record_key(bytes + mid * size) < key) {
+      lo = mid + 1;
+    } else {
+      hi = mid;
+    }
+  }
+  return lo;
+}
+
+void *table_read_keys(const char in_file[MAX_PATH], uint16_t key_encoding,
+                      size_t size, uint64_t start, uint64_t end,
+                      table_header_t *header, size_t *count) {
+  if (in_file == NULL || header == NULL || count == NULL) {
     return NULL;
   }
+  if (end > KEY_SPACE) {
+    end = KEY_SPACE;
+  }
   FILE *fp = fopen(in_file, "rb");
   if (fp == NULL) {
     perror("fopen");
     return NULL;
   }
-  table_t *table = table_init();
-  if (table == NULL) {
+  if (read_header(fp, in_file, header, key_encoding, size) != 0) {
     fclose(fp);
     return NULL;
   }
-  bucket_t tmp;
-  while (fread(&tmp, sizeof(bucket_t), 1, fp) == 1) {
-    bucket_t *bucket = bucket_init(tmp.ip);
-    if (bucket == NULL) {
-      table_free(table);
+
+  // bisect the fences of the octets for the blocks holding the range
+  size_t lo, hi, b0, b1;
+  octet_fences(header, start, end, &lo, &hi);
+  table_fence_t *fences =
+      malloc((hi > lo ? hi - lo : 1) * sizeof(table_fence_t));
+  if (fences == NULL) {
+    fclose(fp);
+    return NULL;
+  }
+  if (hi > lo &&
+      read_at(fp, in_file, fence_offset(header->count, size, lo), fences,
+              sizeof(table_fence_t), hi - lo) != 0) {
+    free(fences);
+    fclose(fp);
+    return NULL;
+  }
+  fence_blocks(fences, hi - lo, start, end, &b0, &b1);
+  size_t first = (lo + b0) * TABLE_FENCE_LEN;
+  size_t last = (lo + b1) * TABLE_FENCE_LEN;
+  if (last > header->count) {
+    last = header->count;
+  }
+  size_t n = b1 > b0 ? last - first : 0;
+
+  char *records = malloc((n ? n : 1) * size);
+  if (records == NULL) {
+    free(fences);
+    fclose(fp);
+    return NULL;
+  }
+  if (n > 0 && read_at(fp, in_file, sizeof(table_header_t) + first * size,
+                       records, size, n) != 0) {
+    free(records);
+    free(fences);
+    fclose(fp);
+    return NULL;
+  }
+  fclose(fp);
+  int ret = check_blocks(fences + b0, lo + b0, b1 - b0, records, size,
+                         header->count, in_file);
+  free(fences);
+  if (ret != 0) {
+    free(records);
+    return NULL;
+  }
+
+  size_t from = keys_lower_bound(records, n, size, start);
+  size_t to = keys_lower_bound(records, n, size, end);
+  memmove(records, records + from * size, (to - from) * size);
+  *count = to - from;
+  return records;
+}
+
+int table_file_count(const char in_file[MAX_PATH], size_t *count) {
+  FILE *fp = fopen(in_file, "rb");
+  if (fp == NULL) {
+    return -1;
+  }
+  table_header_t header;
+  int ok = fread(&header, sizeof(header), 1, fp) == 1 &&
+           header.magic == TABLE_MAGIC;
+  fclose(fp);
+  if (!ok) {
+    return -1;
+  }
+  *count = header.count;
+  return 0;
+}
+
+size_t records_lower_bound(const record_t *records, size_t count,
+                           uint64_t key) {
+  size_t lo = 0, hi = count;
+  while (lo < hi) {
+    size_t mid = lo + (hi - lo) / 2;
+    if (records[mid].key < key) {
+      lo = mid + 1;
+    } else {
+      hi = mid;
+    }
+  }
+  return lo;
+}
+
+void records_pick_bounds(record_t *sample, size_t n_sample, uint64_t bounds[],
+                         int n_reducers) {
+  records_sort(sample, n_sample);
+  bounds[0] = 0;
+  bounds[n_reducers] = KEY_SPACE;
+  for (int i = 1; i < n_reducers; i++) {
+    if (n_sample > 0) {
+      bounds[i] = sample[(size_t)i * n_sample / n_reducers].key;
+    } else {
+      bounds[i] = KEY_SPLIT(i, n_reducers);
+    }
+  }
+}
+
+record_t *table_read_range(const char in_file[MAX_PATH], uint64_t start,
+                           uint64_t end, size_t *count) {
+  table_header_t header;
+  return table_read_keys(in_file, TABLE_KEY_IPV4, sizeof(record_t), start,
+                         end, &header, count);
+}
+
+record_t *table_sample(const char in_file[MAX_PATH], size_t max,
+                       size_t *count) {
+  if (in_file == NULL || count == NULL) {
+    return NULL;
+  }
+  FILE *fp = fopen(in_file, "rb");
+  if (fp == NULL) {
+    perror("fopen");
+    return NULL;
+  }
+  table_header_t header;
+  if (read_header(fp, in_file, &header, TABLE_KEY_IPV4, sizeof(record_t)) !=
+      0) {
+    fclose(fp);
+    return NULL;
+  }
+  size_t total = header.count;
+  size_t n = total < max ? total : max;
+  record_t *records = malloc(n ? n * sizeof(record_t) : 1);
+  if (records == NULL) {
+    fclose(fp);
+    return NULL;
+  }
+  for (size_t i = 0; i < n; i++) {
+    uint64_t offset = sizeof(table_header_t) + i * total / n * sizeof(record_t);
+    if (read_at(fp, in_file, offset, &records[i], sizeof(record_t), 1) != 0) {
+      free(records);
       fclose(fp);
       return NULL;
     }
-    bucket->requests = tmp.requests;
-    if (table_add(table, bucket) != 0) {
-      free(bucket);
-      table_free(table);
-      fclose(fp);
+  }
+  fclose(fp);
+  *count = n;
+  return records;
+}
+
+struct table_run {
+  FILE *fp;
+  size_t left;     // records of the file not read yet
+  int stream;      // a headerless record stream that ends at EOF
+  uint64_t start;
+  uint64_t end;
+  // a file run reads whole blocks and checks each against its fence
+  table_fence_t *fences;    // fences of the blocks read
+  size_t n_blocks;
+  size_t first;       // block number of fences[0]
+  size_t block;       // index in fences of the block of the next record
+  size_t pos;         // index of the next record in the file
+  size_t count;       // records in the file
+  uint32_t hash;      // checksum of the block so far
+};
+
+table_run_t *table_run_open(const char in_file[MAX_PATH], uint64_t start,
+                            uint64_t end) {
+  if (in_file == NULL) {
+    return NULL;
+  }
+  table_run_t *run = calloc(1, sizeof(table_run_t));
+  if (run == NULL) {
+    return NULL;
+  }
+  run->fp = fopen(in_file, "rb");
+  if (run->fp == NULL) {
+    perror("fopen");
+    free(run);
+    return NULL;
+  }
+  table_header_t header;
+  if (read_header(run->fp, in_file, &header, TABLE_KEY_IPV4,
+                  sizeof(record_t)) != 0) {
+    table_run_close(run);
+    return NULL;
+  }
+  run->stream = 0;
+  run->start = start;
+  run->end = end > KEY_SPACE ? KEY_SPACE : end;
+  run->count = header.count;
+  run->hash = TABLE_CHECKSUM_INIT;
+
+  size_t lo, hi, b0, b1;
+  octet_fences(&header, run->start, run->end, &lo, &hi);
+  run->fences = malloc((hi > lo ? hi - lo : 1) * sizeof(table_fence_t));
+  if (run->fences == NULL) {
+    table_run_close(run);
+    return NULL;
+  }
+  if (hi > lo &&
+      read_at(run->fp, in_file, fence_offset(run->count, sizeof(record_t), lo),
+              run->fences, sizeof(table_fence_t), hi - lo) != 0) {
+    table_run_close(run);
+    return NULL;
+  }
+  fence_blocks(run->fences, hi - lo, run->start, run->end, &b0, &b1);
+  memmove(run->fences, run->fences + b0, (b1 - b0) * sizeof(table_fence_t));
+  run->n_blocks = b1 - b0;
+  run->first = lo + b0;
+  run->pos = run->first * TABLE_FENCE_LEN;
+  if (run->n_blocks > 0) {
+    size_t last = (lo + b1) * TABLE_FENCE_LEN;
+    run->left = (last < run->count ? last : run->count) - run->pos;
+    long offset =
+        (long)(sizeof(table_header_t) + run->pos * sizeof(record_t));
+    if (fseek(run->fp, offset, SEEK_SET) != 0) {
+      perror("fseek");
+      table_run_close(run);
       return NULL;
     }
   }
-  if (ferror(fp)) {
-    perror("fread");
-    table_free(table);
-    fclose(fp);
+  return run;
+}
+
+table_run_t *table_run_fdopen(int fd, uint64_t start, uint64_t end) {
+  table_run_t *run = calloc(1, sizeof(table_run_t));
+  if (run == NULL) {
     return NULL;
   }
-  if (fclose(fp) != 0) {
-    perror("fclose");
+  run->fp = fdopen(fd, "rb");
+  if (run->fp == NULL) {
+    perror("fdopen");
+    free(run);
+    return NULL;
+  }
+  run->stream = 1;
+  run->start = start;
+  run->end = end > KEY_SPACE ? KEY_SPACE : end;
+  run->left = start < run->end ? SIZE_MAX : 0;
+  return run;
+}
+
+int parse_fd(const char *arg, int *fd) {
+  char *end;
+  long value = strtol(arg, &end, 10);
+  if (end == arg || *end != '\0' || value < 0 || value > INT32_MAX) {
+    return -1;
+  }
+  *fd = (int)value;
+  return 0;
+}
+
+int parse_fd_list(const char *list, int **fds) {
+  int n = 1;
+  for (const char *p = list; *p; p++) {
+    n += *p == ',';
+  }
+  *fds = malloc(n * sizeof(int));
+  if (*fds == NULL) {
+    return -1;
+  }
+  const char *p = list;
+  for (int i = 0; i < n; i++) {
+    char *end;
+    long fd = strtol(p, &end, 10);
+    if (end == p || fd < 0 || (*end != ',' && *end != '\0')) {
+      free(*fds);
+      *fds = NULL;
+      return -1;
+    }
+    (*fds)[i] = (int)fd;
+    p = end + 1;
+  }
+  return n;
+}
+
+int parse_count(const char *arg, size_t *count) {
+  char *end;
+  long long value = strtoll(arg, &end, 10);
+  if (end == arg || *end != '\0' || value <= 0 || value > INT32_MAX) {
+    return -1;
+  }
+  *count = (size_t)value;
+  return 0;
+}
+
+int records_write_fd(int fd, const record_t *records, size_t count) {
+  const char *buf = (const char *)records;
+  size_t len = count * sizeof(record_t);
+  while (len > 0) {
+    ssize_t n = write(fd, buf, len);
+    if (n < 0) {
+      perror("write");
+      return -1;
+    }
+    buf += n;
+    len -= (size_t)n;
+  }
+  return 0;
+}
+
+int records_print(FILE *fp, const record_t *records, size_t count) {
+  char buf[PRINT_BUF_LEN];
+  size_t len = 0;
+  for (size_t i = 0; i < count; i++) {
+    if (len > sizeof(buf) - RECORD_LINE_LEN) {
+      if (fwrite(buf, 1, len, fp) != len) {
+        perror("fwrite");
+        return -1;
+      }
+      len = 0;
+    }
+    key_to_ip(records[i].key, buf + len);
+    len += strlen(buf + len);
+    memcpy(buf + len, " - ", 3);
+    len += 3;
+
+    long long requests = records[i].requests;
+    if (requests < 0) {
+      buf[len++] = '-';
+      requests = -requests;
+    }
+    char digits[20];
+    int n = 0;
+    do {
+      digits[n++] = (char)('0' + requests % 10);
+      requests /= 10;
+    } while (requests > 0);
+    while (n > 0) {
+      buf[len++] = digits[--n];
+    }
+    buf[len++] = '\n';
+  }
+  if (len > 0 && fwrite(buf, 1, len, fp) != len) {
+    perror("fwrite");
+    return -1;
+  }
+  return 0;
+}
+
+// Check the blocks of a file run that end before record pos, or every
+// block left once the run is done
+static int run_check(table_run_t *run, int done) {
+  while (run->block < run->n_blocks &&
+         (done ||
+          run->pos == (run->first + run->block + 1) * TABLE_FENCE_LEN)) {
+    if (run->hash != run->fences[run->block].checksum) {
+      fprintf(stderr, "table: checksum mismatch in run\n");
+      return -1;
+    }
+    run->block++;
+    run->hash = TABLE_CHECKSUM_INIT;
+  }
+  return 0;
+}
+
+int table_run_next(table_run_t *run, record_t *record) {
+  while (run->left > 0) {
+    if (fread(record, sizeof(record_t), 1, run->fp) != 1) {
+      if (run->stream && feof(run->fp) && !ferror(run->fp)) {
+        run->left = 0;
+        return 0;
+      }
+      if (ferror(run->fp)) {
+        perror("fread");
+      } else {
+        fprintf(stderr, "table: truncated run\n");
+      }
+      return -1;
+    }
+    run->left--;
+    if (!run->stream) {
+      // records past end are still read to finish the checksum of their
+      // block
+      if (run_check(run, 0) != 0) {
+        return -1;
+      }
+      if (run->pos % TABLE_FENCE_LEN == 0 &&
+          record->key != run->fences[run->block].key) {
+        fprintf(stderr, "table: checksum mismatch in run\n");
+        return -1;
+      }
+      run->hash = records_checksum(run->hash, record, 1);
+      run->pos++;
+    } else if (record->key >= run->end) {
+      run->left = 0;
+    }
+    if (record->key >= run->start && record->key < run->end) {
+      return 1;
+    }
+  }
+  return run_check(run, 1) != 0 ? -1 : 0;
+}
+
+void table_run_close(table_run_t *run) {
+  if (run == NULL) {
+    return;
+  }
+  fclose(run->fp);
+  free(run->fences);
+  free(run);
+}
+
+table_view_t *table_view_open(const char in_file[MAX_PATH]) {
+  if (in_file == NULL) {
+    return NULL;
+  }
+  int fd = open(in_file, O_RDONLY);
+  if (fd < 0) {
+    perror("open");
+    return NULL;
+  }
+  struct stat st;
+  if (fstat(fd, &st) != 0) {
+    perror("fstat");
+    close(fd);
+    return NULL;
+  }
+  if ((size_t)st.st_size < sizeof(table_header_t)) {
+    fprintf(stderr, "table: missing header in %s\n", in_file);
+    close(fd);
+    return NULL;
+  }
+  void *map = mmap(NULL, (size_t)st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+  close(fd);
+  if (map == MAP_FAILED) {
+    perror("mmap");
+    return NULL;
+  }
+  const table_header_t *header = map;
+  if (check_header(header, in_file, (uint64_t)st.st_size, TABLE_KEY_IPV4,
+                   sizeof(record_t)) != 0) {
+    munmap(map, (size_t)st.st_size);
+    return NULL;
+  }
+  table_view_t *view = malloc(sizeof(table_view_t));
+  if (view == NULL) {
+    munmap(map, (size_t)st.st_size);
+    return NULL;
+  }
+  view->header = header;
+  view->records = (const record_t *)(header + 1);
+  view->fences = (const table_fence_t *)(view->records + header->count);
+  view->count = header->count;
+  view->map_len = (size_t)st.st_size;
+  return view;
+}
+
+const record_t *table_view_range(const table_view_t *view, uint64_t start,
+                                 uint64_t end, size_t *count) {
+  if (end > KEY_SPACE) {
+    end = KEY_SPACE;
+  }
+  if (start >= end) {
+    *count = 0;
+    return view->records;
+  }
+  // narrow down to whole octets with the index, then binary search the ends
+  size_t first = view->header->index[start >> 24];
+  size_t last = view->header->index[(end + 0xffffff) >> 24];
+  const record_t *records = view->records + first;
+  size_t from = records_lower_bound(records, last - first, start);
+  size_t to = records_lower_bound(records, last - first, end);
+  *count = to - from;
+  return records + from;
+}
+
+int table_view_verify(const table_view_t *view, const char in_file[MAX_PATH]) {
+  if (records_checksum(TABLE_CHECKSUM_INIT, view->records, view->count) !=
+      view->header->checksum) {
+    fprintf(stderr, "table: checksum mismatch in %s\n", in_file);
+    return -1;
+  }
+  return 0;
+}
+
+int table_view_verify_range(const table_view_t *view, uint64_t start,
+                            uint64_t end, const char in_file[MAX_PATH]) {
+  if (end > KEY_SPACE) {
+    end = KEY_SPACE;
+  }
+  size_t lo, hi, b0, b1;
+  octet_fences(view->header, start, end, &lo, &hi);
+  fence_blocks(view->fences + lo, hi - lo, start, end, &b0, &b1);
+  return check_blocks(view->fences + lo + b0, lo + b0, b1 - b0,
+                      view->records + (lo + b0) * TABLE_FENCE_LEN,
+                      sizeof(record_t), view->count, in_file);
+}
+
+void table_view_close(table_view_t *view) {
+  if (view == NULL) {
+    return;
+  }
+  munmap((void *)view->header, view->map_len);
+  free(view);
+}
+
+// Entry of the merge heap, the smallest key not written yet of one run
+struct merge_head {
+  record_t record;
+  table_run_t *run;
+};
+
+// Restore the min heap property below heap[i]
+static void sift_down(struct merge_head *heap, size_t n, size_t i) {
+  for (;;) {
+    size_t min = i;
+    size_t left = 2 * i + 1, right = 2 * i + 2;
+    if (left < n && heap[left].record.key < heap[min].record.key) {
+      min = left;
+    }
+    if (right < n && heap[right].record.key < heap[min].record.key) {
+      min = right;
+    }
+    if (min == i) {
+      return;
+    }
+    struct merge_head tmp = heap[i];
+    heap[i] = heap[min];
+    heap[min] = tmp;
+    i = min;
+  }
+}
+
+static void close_runs(struct merge_head *heap, size_t n) {
+  for (size_t i = 0; i < n; i++) {
+    table_run_close(heap[i].run);
+  }
+  free(heap);
+}
+
+int table_merge_runs(table_run_t *runs[], size_t n_runs,
+                     const char out_file[MAX_PATH], size_t *n_read) {
+  // read the first record of every run
+  struct merge_head *heap = malloc((n_runs ? n_runs : 1) * sizeof(*heap));
+  if (heap == NULL) {
+    for (size_t i = 0; i < n_runs; i++) {
+      table_run_close(runs[i]);
+    }
+    return -1;
+  }
+  size_t n = 0;
+  for (size_t i = 0; i < n_runs; i++) {
+    int got = table_run_next(runs[i], &heap[n].record);
+    if (got <= 0) {
+      table_run_close(runs[i]);
+      if (got < 0) {
+        for (size_t j = i + 1; j < n_runs; j++) {
+          table_run_close(runs[j]);
+        }
+        close_runs(heap, n);
+        return -1;
+      }
+      continue;
+    }
+    heap[n++].run = runs[i];
+  }
+  size_t merged = n;
+
+  for (size_t i = n / 2; i-- > 0;) {
+    sift_down(heap, n, i);
+  }
+
+  table_writer_t *writer = table_writer_open(out_file);
+  if (writer == NULL) {
+    close_runs(heap, n);
+    return -1;
+  }
+
+  // pop the smallest key, summing it up while it stays on top
+  record_t out = {0, 0};
+  int pending = 0;
+  while (n > 0) {
+    if (pending && heap[0].record.key != out.key) {
+      if (table_writer_add(writer, &out) != 0) {
+        table_writer_abort(writer);
+        close_runs(heap, n);
+        return -1;
+      }
+      pending = 0;
+    }
+    if (!pending) {
+      out.key = heap[0].record.key;
+      out.requests = 0;
+      pending = 1;
+    }
+    out.requests += heap[0].record.requests;
+
+    int got = table_run_next(heap[0].run, &heap[0].record);
+    if (got < 0) {
+      table_writer_abort(writer);
+      close_runs(heap, n);
+      return -1;
+    }
+    merged += got;
+    if (got == 0) {
+      table_run_close(heap[0].run);
+      heap[0] = heap[--n];
+    }
+    sift_down(heap, n, 0);
+  }
+  free(heap);
+  if (n_read != NULL) {
+    *n_read = merged;
+  }
+
+  if (pending && table_writer_add(writer, &out) != 0) {
+    table_writer_abort(writer);
+    return -1;
+  }
+  return table_writer_close(writer);
+}
+
+int table_merge(const char *in_files[], size_t n_files, uint64_t start,
+                uint64_t end, const char out_file[MAX_PATH], size_t *n_read) {
+  if ((in_files == NULL && n_files > 0) || out_file == NULL) {
+    return -1;
+  }
+  table_run_t **runs = malloc((n_files ? n_files : 1) * sizeof(table_run_t *));
+  if (runs == NULL) {
+    return -1;
+  }
+  for (size_t i = 0; i < n_files; i++) {
+    runs[i] = table_run_open(in_files[i], start, end);
+    if (runs[i] == NULL) {
+      for (size_t j = 0; j < i; j++) {
+        table_run_close(runs[j]);
+      }
+      free(runs);
+      return -1;
+    }
+  }
+  int ret = table_merge_runs(runs, n_files, out_file, n_read);
+  free(runs);
+  return ret;
+}
+
+table_t *table_from_file(const char in_file[MAX_PATH]) {
+  if (in_file == NULL) {
+    return NULL;
+  }
+  size_t count;
+  record_t *records = table_read_range(in_file, 0, KEY_SPACE, &count);
+  if (records == NULL) {
+    return NULL;
+  }
+  table_t *table = table_init();
+  if (table == NULL || table_reserve(table, count) != 0) {
     table_free(table);
+    free(records);
     return NULL;
   }
+  for (size_t i = 0; i < count; i++) {
+    bucket_t *bucket = table_add_key(table, records[i].key);
+    if (bucket == NULL) {
+      table_free(table);
+      free(records);
+      return NULL;
+    }
+    bucket->requests = records[i].requests;
+  }
+  free(records);
   return table;
 }
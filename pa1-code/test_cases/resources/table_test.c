@@ -1,11 +1,14 @@
 #include "../../include/table.h"
+#include "../../include/topk.h"
 
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <unistd.h>
 
 char LOCALHOST[IP_LEN] = "127.0.0.1";
 char TABLE_FILE_PATH[MAX_PATH] = "./test_cases/resources/0.tbl";
+char MERGE_FILE_PATH[MAX_PATH] = "./test_cases/resources/1.tbl";
 
 // Checks that all keys of table exist in other with the same values
 // and that all keys of other exist in table with the same values
@@ -13,35 +16,33 @@ int table_equal(table_t *table, table_t *other) {
     bucket_t *ptr;
     bucket_t *other_ptr;
 
-    for (int i = 0; i < TABLE_LEN; i++) {
-        // check relation from table to other
+    // check relation from table to other
+    for (size_t i = 0; i < table->count; i++) {
         ptr = table->buckets[i];
-        while (ptr != NULL) {
-            if ((other_ptr = table_get(other, ptr->ip)) == NULL) {
-                printf("could not find bucket in other table\n");
-                return -1;
-            }
+        if ((other_ptr = table_get_key(other, ptr->key)) == NULL) {
+            printf("could not find bucket in other table\n");
+            return -1;
+        }
 
-            if (other_ptr->requests != ptr->requests) {
-                printf("other table requests not euqal\n");
-                return -1;
-            }
-            ptr = ptr->next;
+        if (other_ptr->requests != ptr->requests) {
+            printf("other table requests not euqal\n");
+            return -1;
         }
+    }
 
-        // check relation from other to table
+    // check relation from other to table
+    for (size_t i = 0; i < other->count; i++) {
         ptr = other->buckets[i];
-        while (ptr != NULL) {
-            if ((other_ptr = table_get(table, ptr->ip)) == NULL) {
-                printf("could not find bucket in other table reverse\n ip: %s\n", ptr->ip);
-                return -1;
-            }
+        if ((other_ptr = table_get_key(table, ptr->key)) == NULL) {
+            char ip[IP_LEN];
+            key_to_ip(ptr->key, ip);
+            printf("could not find bucket in other table reverse\n ip: %s\n", ip);
+            return -1;
+        }
 
-            if (other_ptr->requests != ptr->requests) {
-                printf("other table requests not euqal reverse\n");
-                return -1;
-            }
-            ptr = ptr->next;
+        if (other_ptr->requests != ptr->requests) {
+            printf("other table requests not euqal reverse\n");
+            return -1;
         }
     }
 
@@ -126,7 +127,7 @@ int test_table_add_and_get() {
         bucket_t *bucket = bucket_init(ip_buf);
         table_add(table, bucket);
 
-        bucket_t *other = table_get(table, bucket->ip);
+        bucket_t *other = table_get(table, ip_buf);
         if (other == NULL) {
             printf("bucket pointer is null after valid table get\n");
             return -1;
@@ -137,8 +138,8 @@ int test_table_add_and_get() {
             return -1;
         }
 
-        if (strcmp(other->ip, bucket->ip) != 0) {
-            printf("bucket IPs do not match\n");
+        if (other->key != bucket->key) {
+            printf("bucket keys do not match\n");
             table_free(table);
             return -1;
         }
@@ -159,7 +160,7 @@ int test_table_add_and_get_collision() {
         bucket_t *bucket = bucket_init(ip_buf);
         table_add(table, bucket);
 
-        bucket_t *other = table_get(table, bucket->ip);
+        bucket_t *other = table_get(table, ip_buf);
         if (other == NULL) {
             printf("null ptr value from valid table get\n");
             return -1;
@@ -171,8 +172,8 @@ int test_table_add_and_get_collision() {
             return -1;
         }
 
-        if (strcmp(other->ip, bucket->ip) != 0) {
-            printf("bucket IPs do not match\n");
+        if (other->key != bucket->key) {
+            printf("bucket keys do not match\n");
             table_free(table);
             return -1;
         }
@@ -237,6 +238,475 @@ int test_table_from_file() {
     return res;
 }
 
+// Write a table of 10.0.0.0 to 10.0.0.49 and 127.0.0.0 to 127.0.0.49,
+// where the i-th address of each network has i + 1 requests, so its
+// records fill two octets of the index
+int write_two_octet_table() {
+    table_t *table = table_init();
+    for (int i = 0; i < 50; i++) {
+        char ip_buf[IP_LEN];
+        sprintf(ip_buf, "10.0.0.%d", i);
+        bucket_t *bucket = bucket_init(ip_buf);
+        table_add(table, bucket);
+        bucket->requests = i + 1;
+
+        sprintf(ip_buf, "127.0.0.%d", i);
+        bucket = bucket_init(ip_buf);
+        table_add(table, bucket);
+        bucket->requests = i + 1;
+    }
+
+    int res = table_to_file(table, TABLE_FILE_PATH);
+    table_free(table);
+    if (res != 0) {
+        printf("failed to write table to file\n");
+    }
+    return res;
+}
+
+// Write a table of 3 * TABLE_FENCE_LEN consecutive addresses from
+// 10.0.0.0 on, where the i-th has i + 1 requests, so its records fill
+// three blocks of a single octet
+int write_fenced_table() {
+    uint32_t net10;
+    ip_to_key("10.0.0.0", &net10);
+    table_t *table = table_init();
+    for (int i = 0; i < 3 * TABLE_FENCE_LEN; i++) {
+        table_add_key(table, net10 + i)->requests = i + 1;
+    }
+
+    int res = table_to_file(table, TABLE_FILE_PATH);
+    table_free(table);
+    if (res != 0) {
+        printf("failed to write table to file\n");
+    }
+    return res;
+}
+
+// Overwrite len bytes of the table file at offset with data
+int corrupt_table(long offset, const void *data, size_t len) {
+    FILE *fp = fopen(TABLE_FILE_PATH, "r+b");
+    if (fp == NULL) {
+        printf("failed to open table file\n");
+        return -1;
+    }
+    if (fseek(fp, offset, SEEK_SET) != 0 || fwrite(data, len, 1, fp) != 1) {
+        printf("failed to corrupt table file\n");
+        fclose(fp);
+        return -1;
+    }
+    fclose(fp);
+    return 0;
+}
+
+// Checks that every reader refuses the table file
+int table_rejected() {
+    table_t *table = table_from_file(TABLE_FILE_PATH);
+    if (table != NULL) {
+        printf("table_from_file accepted a bad table\n");
+        table_free(table);
+        return -1;
+    }
+
+    table_view_t *view = table_view_open(TABLE_FILE_PATH);
+    if (view != NULL) {
+        printf("table_view_open accepted a bad table\n");
+        table_view_close(view);
+        return -1;
+    }
+
+    table_run_t *run = table_run_open(TABLE_FILE_PATH, 0, KEY_SPACE);
+    if (run != NULL) {
+        printf("table_run_open accepted a bad table\n");
+        table_run_close(run);
+        return -1;
+    }
+    return 0;
+}
+
+int test_table_file_format() {
+    if (write_two_octet_table() != 0) {
+        return -1;
+    }
+
+    FILE *fp = fopen(TABLE_FILE_PATH, "rb");
+    if (fp == NULL) {
+        printf("failed to open table file\n");
+        return -1;
+    }
+    table_header_t header;
+    record_t records[100];
+    table_fence_t fence;
+    size_t n = 0;
+    if (fread(&header, sizeof(header), 1, fp) == 1 &&
+        fread(records, sizeof(record_t), 100, fp) == 100) {
+        n = fread(&fence, sizeof(fence), 1, fp);
+    }
+    int extra = fgetc(fp);
+    fclose(fp);
+
+    if (n != 1 || extra != EOF) {
+        printf("table file does not hold a header, 100 records and a fence\n");
+        return -1;
+    }
+    if (header.magic != TABLE_MAGIC || header.version != TABLE_VERSION ||
+        header.key_encoding != TABLE_KEY_IPV4 || header.count != 100 ||
+        header.floor != 0) {
+        printf("table header has wrong fields\n");
+        return -1;
+    }
+    for (int o = 0; o <= TABLE_INDEX_LEN; o++) {
+        uint32_t expected = o <= 10 ? 0 : o <= 127 ? 50 : 100;
+        if (header.index[o] != expected) {
+            printf("index of octet %d is %u, not %u\n", o, header.index[o],
+                   expected);
+            return -1;
+        }
+    }
+    for (int i = 1; i < 100; i++) {
+        if (records[i - 1].key >= records[i].key) {
+            printf("records are not sorted by key\n");
+            return -1;
+        }
+    }
+    if (table_checksum(TABLE_CHECKSUM_INIT, records, sizeof(records)) !=
+        header.checksum) {
+        printf("checksum of the records does not match the header\n");
+        return -1;
+    }
+    if (fence.key != records[0].key || fence.checksum != header.checksum) {
+        printf("fence of the only block does not match the records\n");
+        return -1;
+    }
+    return 0;
+}
+
+int test_table_bad_magic() {
+    if (write_two_octet_table() != 0) {
+        return -1;
+    }
+    uint32_t magic = TABLE_MAGIC ^ 1;
+    if (corrupt_table(0, &magic, sizeof(magic)) != 0) {
+        return -1;
+    }
+    return table_rejected();
+}
+
+int test_table_bad_version() {
+    if (write_two_octet_table() != 0) {
+        return -1;
+    }
+    uint16_t version = TABLE_VERSION + 1;
+    if (corrupt_table(4, &version, sizeof(version)) != 0) {
+        return -1;
+    }
+    return table_rejected();
+}
+
+int test_table_bad_checksum() {
+    if (write_fenced_table() != 0) {
+        return -1;
+    }
+    // the requests of the 45th record of the second block
+    int requests = 1000;
+    long offset =
+        sizeof(table_header_t) + (TABLE_FENCE_LEN + 44) * sizeof(record_t) + 4;
+    if (corrupt_table(offset, &requests, sizeof(requests)) != 0) {
+        return -1;
+    }
+
+    // the first and last block are intact, the middle one is not
+    uint32_t net10;
+    ip_to_key("10.0.0.0", &net10);
+    uint64_t first_end = net10 + TABLE_FENCE_LEN;
+    uint64_t last_start = net10 + 2 * TABLE_FENCE_LEN + 1;
+    uint64_t bad = net10 + TABLE_FENCE_LEN + 44;
+
+    // only readers of the corrupt block fail
+    table_t *table = table_from_file(TABLE_FILE_PATH);
+    if (table != NULL) {
+        printf("table_from_file accepted a bad checksum\n");
+        table_free(table);
+        return -1;
+    }
+    size_t count;
+    record_t *records =
+        table_read_range(TABLE_FILE_PATH, net10, first_end, &count);
+    if (records == NULL || count != TABLE_FENCE_LEN) {
+        printf("table_read_range failed on an intact block\n");
+        free(records);
+        return -1;
+    }
+    free(records);
+    records = table_read_range(TABLE_FILE_PATH, last_start, KEY_SPACE, &count);
+    if (records == NULL || count != TABLE_FENCE_LEN - 1) {
+        printf("table_read_range failed on an intact block\n");
+        free(records);
+        return -1;
+    }
+    free(records);
+    records = table_read_range(TABLE_FILE_PATH, bad, bad + 1, &count);
+    if (records != NULL) {
+        printf("table_read_range accepted a bad checksum\n");
+        free(records);
+        return -1;
+    }
+
+    table_view_t *view = table_view_open(TABLE_FILE_PATH);
+    if (view == NULL) {
+        printf("table_view_open failed\n");
+        return -1;
+    }
+    int res = 0;
+    if (table_view_verify_range(view, net10, first_end, TABLE_FILE_PATH) != 0 ||
+        table_view_verify_range(view, last_start, KEY_SPACE,
+                                TABLE_FILE_PATH) != 0) {
+        printf("table_view_verify_range failed on an intact block\n");
+        res = -1;
+    } else if (table_view_verify(view, TABLE_FILE_PATH) == 0 ||
+               table_view_verify_range(view, bad, bad + 1,
+                                       TABLE_FILE_PATH) == 0) {
+        printf("table view accepted a bad checksum\n");
+        res = -1;
+    }
+    table_view_close(view);
+    if (res != 0) {
+        return res;
+    }
+
+    const char *in_files[] = {TABLE_FILE_PATH};
+    if (table_merge(in_files, 1, last_start, KEY_SPACE, MERGE_FILE_PATH,
+                    NULL) != 0) {
+        printf("table_merge failed on an intact block\n");
+        res = -1;
+    } else if (table_merge(in_files, 1, 0, KEY_SPACE, MERGE_FILE_PATH,
+                           NULL) == 0) {
+        printf("table_merge accepted a bad checksum\n");
+        res = -1;
+    }
+    unlink(MERGE_FILE_PATH);
+    return res;
+}
+
+int test_table_truncated() {
+    if (write_two_octet_table() != 0) {
+        return -1;
+    }
+    // one record short
+    long size = sizeof(table_header_t) + 99 * sizeof(record_t);
+    if (truncate(TABLE_FILE_PATH, size) != 0 || table_rejected() != 0) {
+        return -1;
+    }
+    // not even a whole header
+    if (truncate(TABLE_FILE_PATH, sizeof(table_header_t) / 2) != 0) {
+        return -1;
+    }
+    return table_rejected();
+}
+
+// Checks that every range reader finds n records from key first on for
+// [start, end) of the table file
+int check_range(uint64_t start, uint64_t end, size_t n, uint64_t first) {
+    size_t count;
+    record_t *records = table_read_range(TABLE_FILE_PATH, start, end, &count);
+    if (records == NULL || count != n || (n > 0 && records[0].key != first)) {
+        printf("table_read_range returned the wrong records\n");
+        free(records);
+        return -1;
+    }
+    free(records);
+
+    table_view_t *view = table_view_open(TABLE_FILE_PATH);
+    if (view == NULL) {
+        return -1;
+    }
+    const record_t *in_view = table_view_range(view, start, end, &count);
+    int res = count != n || (n > 0 && in_view[0].key != first) ? -1 : 0;
+    table_view_close(view);
+    if (res != 0) {
+        printf("table_view_range returned the wrong records\n");
+        return -1;
+    }
+
+    table_run_t *run = table_run_open(TABLE_FILE_PATH, start, end);
+    if (run == NULL) {
+        return -1;
+    }
+    record_t record;
+    count = 0;
+    while ((res = table_run_next(run, &record)) == 1) {
+        if ((count == 0 && record.key != first) || record.key < start ||
+            record.key >= end) {
+            res = -1;
+            break;
+        }
+        count++;
+    }
+    table_run_close(run);
+    if (res != 0 || count != n) {
+        printf("table run returned the wrong records\n");
+        return -1;
+    }
+    return 0;
+}
+
+int test_table_read_range() {
+    if (write_two_octet_table() != 0) {
+        return -1;
+    }
+    uint32_t a, b, c, d;
+    ip_to_key("10.0.0.10", &a);
+    ip_to_key("10.0.0.20", &b);
+    ip_to_key("127.0.0.0", &c);
+    ip_to_key("127.0.0.49", &d);
+
+    if (check_range(0, KEY_SPACE, 100, a - 10) != 0 ||
+        check_range(a, b, 10, a) != 0 ||
+        check_range(b, d, 79, b) != 0 ||
+        check_range(a - 10 + (1 << 24), c, 0, 0) != 0 ||
+        check_range(d, KEY_SPACE, 1, d) != 0 ||
+        check_range(b, b, 0, 0) != 0) {
+        return -1;
+    }
+
+    // ranges within one octet are bisected down to the record
+    if (write_fenced_table() != 0) {
+        return -1;
+    }
+    uint32_t net10 = a - 10;
+    if (check_range(net10 + 100, net10 + 700, 600, net10 + 100) != 0 ||
+        check_range(net10 + TABLE_FENCE_LEN, net10 + TABLE_FENCE_LEN + 1, 1,
+                    net10 + TABLE_FENCE_LEN) != 0 ||
+        check_range(net10 + 3 * TABLE_FENCE_LEN - 1, KEY_SPACE, 1,
+                    net10 + 3 * TABLE_FENCE_LEN - 1) != 0 ||
+        check_range(net10 + 3 * TABLE_FENCE_LEN, KEY_SPACE, 0, 0) != 0) {
+        return -1;
+    }
+    return 0;
+}
+
+// Checks one merged counter
+int check_entry(const topk_entry_t *entry, uint32_t key, int count,
+                int error) {
+    if (entry->key != key || entry->count != count || entry->error != error) {
+        printf("merged counter %u is %d error=%d, not %u %d error=%d\n",
+               entry->key, entry->count, entry->error, key, count, error);
+        return -1;
+    }
+    return 0;
+}
+
+int test_topk_merge() {
+    // key 3 is missing from the first summary and key 1 from the second,
+    // each is charged the floor of the summary that lacks it
+    topk_entry_t first[] = {{1, 10, 0}, {2, 5, 0}};
+    topk_entry_t second[] = {{2, 7, 1}, {3, 4, 0}};
+    topk_entry_t *entries[] = {first, second};
+    size_t counts[] = {2, 2};
+    uint32_t floors[] = {3, 2};
+
+    size_t count;
+    uint32_t floor;
+    topk_entry_t *merged =
+        topk_merge(entries, counts, floors, 2, 10, &count, &floor);
+    if (merged == NULL || count != 3 || floor != 5 ||
+        check_entry(&merged[0], 1, 12, 2) != 0 ||
+        check_entry(&merged[1], 2, 12, 1) != 0 ||
+        check_entry(&merged[2], 3, 7, 3) != 0) {
+        printf("merge without eviction is wrong\n");
+        free(merged);
+        return -1;
+    }
+    free(merged);
+
+    // with room for two the smallest counter is dropped and raises the floor
+    merged = topk_merge(entries, counts, floors, 2, 2, &count, &floor);
+    if (merged == NULL || count != 2 || floor != 7 ||
+        check_entry(&merged[0], 1, 12, 2) != 0 ||
+        check_entry(&merged[1], 2, 12, 1) != 0) {
+        printf("merge with eviction is wrong\n");
+        free(merged);
+        return -1;
+    }
+    free(merged);
+    return 0;
+}
+
+int test_topk_bounds() {
+    // key k gets k requests, interleaved, in summaries too small to hold
+    // every key
+    enum { N_KEYS = 200, CAPACITY = 32 };
+    topk_t *summaries[2] = {topk_init(CAPACITY), topk_init(CAPACITY)};
+    if (summaries[0] == NULL || summaries[1] == NULL) {
+        topk_free(summaries[0]);
+        topk_free(summaries[1]);
+        return -1;
+    }
+    for (int round = 0; round < N_KEYS; round++) {
+        for (uint32_t key = round + 1; key <= N_KEYS; key++) {
+            topk_add(summaries[key % 3 == 0], key, 1);
+        }
+    }
+
+    topk_entry_t *entries[2];
+    size_t counts[2];
+    uint32_t floors[2];
+    for (int s = 0; s < 2; s++) {
+        floors[s] = topk_floor(summaries[s]);
+        counts[s] = summaries[s]->count;
+        entries[s] = summaries[s]->entries;
+        topk_to_file(summaries[s], TABLE_FILE_PATH);
+        // the summary file gives back the same entries and floor
+        size_t n;
+        uint32_t floor;
+        topk_entry_t *read =
+            topk_read_range(TABLE_FILE_PATH, 0, KEY_SPACE, &n, &floor);
+        if (read == NULL || n != counts[s] || floor != floors[s] ||
+            memcmp(read, entries[s], n * sizeof(topk_entry_t)) != 0) {
+            printf("summary file does not match the summary\n");
+            free(read);
+            topk_free(summaries[0]);
+            topk_free(summaries[1]);
+            return -1;
+        }
+        free(read);
+    }
+
+    size_t count;
+    uint32_t floor;
+    topk_entry_t *merged =
+        topk_merge(entries, counts, floors, 2, CAPACITY, &count, &floor);
+    topk_free(summaries[0]);
+    topk_free(summaries[1]);
+    if (merged == NULL) {
+        return -1;
+    }
+
+    // every counter brackets the true count, and every key left out has
+    // at most floor requests
+    int res = 0;
+    size_t next = 0;
+    for (uint32_t key = 1; key <= N_KEYS; key++) {
+        if (next < count && merged[next].key == key) {
+            if ((uint32_t)merged[next].count < key ||
+                (uint32_t)(merged[next].count - merged[next].error) > key) {
+                printf("counter of key %u does not bound its count\n", key);
+                res = -1;
+            }
+            next++;
+        } else if (key > floor) {
+            printf("key %u is left out but has more than the floor\n", key);
+            res = -1;
+        }
+    }
+    if (count != CAPACITY || next != count) {
+        printf("merged summary has %zu counters\n", count);
+        res = -1;
+    }
+    free(merged);
+    return res;
+}
+
 int print_table_path(const char file_path[MAX_PATH]) {
     table_t* table = table_from_file(file_path);
     if (table == NULL) {
@@ -300,6 +770,46 @@ int main(int argc, char *argv[]) {
             printf("test failed: table_from_file\n");
             return -1;
         }
+    } else if (strcmp(argv[1], "table_file_format") == 0) {
+        if (test_table_file_format() != 0) {
+            printf("test failed: table_file_format\n");
+            return -1;
+        }
+    } else if (strcmp(argv[1], "table_bad_magic") == 0) {
+        if (test_table_bad_magic() != 0) {
+            printf("test failed: table_bad_magic\n");
+            return -1;
+        }
+    } else if (strcmp(argv[1], "table_bad_version") == 0) {
+        if (test_table_bad_version() != 0) {
+            printf("test failed: table_bad_version\n");
+            return -1;
+        }
+    } else if (strcmp(argv[1], "table_bad_checksum") == 0) {
+        if (test_table_bad_checksum() != 0) {
+            printf("test failed: table_bad_checksum\n");
+            return -1;
+        }
+    } else if (strcmp(argv[1], "table_truncated") == 0) {
+        if (test_table_truncated() != 0) {
+            printf("test failed: table_truncated\n");
+            return -1;
+        }
+    } else if (strcmp(argv[1], "table_read_range") == 0) {
+        if (test_table_read_range() != 0) {
+            printf("test failed: table_read_range\n");
+            return -1;
+        }
+    } else if (strcmp(argv[1], "topk_merge") == 0) {
+        if (test_topk_merge() != 0) {
+            printf("test failed: topk_merge\n");
+            return -1;
+        }
+    } else if (strcmp(argv[1], "topk_bounds") == 0) {
+        if (test_topk_bounds() != 0) {
+            printf("test failed: topk_bounds\n");
+            return -1;
+        }
     } else if (strcmp(argv[1], "print_table_path") == 0) {
         if (argc < 3 || strlen(argv[2]) < 3) {
             printf("invalid arguments to print_table_path\n");
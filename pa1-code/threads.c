@@ -0,0 +1,239 @@
+#include "./include/threads.h"
+
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "./include/map.h"
+
+// State shared by every thread of a job
+struct engine {
+  char **tasks;
+  int n_tasks;
+  int next_task;           // next task to hand out, guarded by lock
+  int failed;              // set by any thread that fails, guarded by lock
+  pthread_mutex_t lock;
+
+  int n_mappers;
+  record_t **runs;         // sorted output of every mapper
+  size_t *run_lens;
+
+  int n_reducers;
+  uint64_t *bounds;        // reducer i owns [bounds[i], bounds[i + 1])
+  record_t **outs;         // sorted output of every reducer
+  size_t *out_lens;
+};
+
+struct worker {
+  struct engine *engine;
+  int id;
+};
+
+static void engine_fail(struct engine *engine) {
+  pthread_mutex_lock(&engine->lock);
+  engine->failed = 1;
+  pthread_mutex_unlock(&engine->lock);
+}
+
+// Count the tasks this mapper pulls into a table, then store its
+// contents as a sorted run
+static void *map_thread(void *arg) {
+  struct worker *worker = arg;
+  struct engine *engine = worker->engine;
+
+  table_t *table = table_init();
+  if (table == NULL) {
+    engine_fail(engine);
+    return NULL;
+  }
+
+  for (;;) {
+    pthread_mutex_lock(&engine->lock);
+    int t = engine->failed ? engine->n_tasks : engine->next_task++;
+    pthread_mutex_unlock(&engine->lock);
+    if (t >= engine->n_tasks) {
+      break;
+    }
+    if (map_input(table, engine->tasks[t], 1) != 0) {
+      fprintf(stderr, "Failed to map log file: %s\n", engine->tasks[t]);
+      engine_fail(engine);
+      break;
+    }
+  }
+
+  record_t *run = malloc(table->count ? table->count * sizeof(record_t) : 1);
+  if (run == NULL) {
+    table_free(table);
+    engine_fail(engine);
+    return NULL;
+  }
+  for (size_t i = 0; i < table->count; i++) {
+    run[i].key = table->buckets[i]->key;
+    run[i].requests = table->buckets[i]->requests;
+  }
+  records_sort(run, table->count);
+  engine->runs[worker->id] = run;
+  engine->run_lens[worker->id] = table->count;
+  table_free(table);
+  return NULL;
+}
+
+// Gather the key range of this reducer from every run, sort it and sum
+// the counts of equal keys
+static void *reduce_thread(void *arg) {
+  struct worker *worker = arg;
+  struct engine *engine = worker->engine;
+  uint64_t start = engine->bounds[worker->id];
+  uint64_t end = engine->bounds[worker->id + 1];
+
+  size_t from[engine->n_mappers], to[engine->n_mappers];
+  size_t total = 0;
+  for (int m = 0; m < engine->n_mappers; m++) {
+    from[m] = records_lower_bound(engine->runs[m], engine->run_lens[m], start);
+    to[m] = records_lower_bound(engine->runs[m], engine->run_lens[m], end);
+    total += to[m] - from[m];
+  }
+
+  record_t *out = malloc(total ? total * sizeof(record_t) : 1);
+  if (out == NULL) {
+    engine_fail(engine);
+    return NULL;
+  }
+  size_t n = 0;
+  for (int m = 0; m < engine->n_mappers; m++) {
+    memcpy(out + n, engine->runs[m] + from[m],
+           (to[m] - from[m]) * sizeof(record_t));
+    n += to[m] - from[m];
+  }
+  records_sort(out, n);
+
+  size_t unique = 0;
+  for (size_t i = 0; i < n; i++) {
+    if (unique > 0 && out[unique - 1].key == out[i].key) {
+      out[unique - 1].requests += out[i].requests;
+    } else {
+      out[unique++] = out[i];
+    }
+  }
+  engine->outs[worker->id] = out;
+  engine->out_lens[worker->id] = unique;
+  return NULL;
+}
+
+// Pick the reducer bounds from an even sample of every run with
+// records_pick_bounds
+static int sample_bounds(struct engine *engine) {
+  record_t *sample =
+      malloc(sizeof(record_t) * SAMPLES_PER_RUN * engine->n_mappers);
+  if (sample == NULL) {
+    return -1;
+  }
+  size_t n_sample = 0;
+  for (int m = 0; m < engine->n_mappers; m++) {
+    size_t len = engine->run_lens[m];
+    size_t n = len < SAMPLES_PER_RUN ? len : SAMPLES_PER_RUN;
+    for (size_t i = 0; i < n; i++) {
+      sample[n_sample++] = engine->runs[m][i * len / n];
+    }
+  }
+  records_pick_bounds(sample, n_sample, engine->bounds, engine->n_reducers);
+  free(sample);
+  return 0;
+}
+
+// Start one thread per worker running fn and wait for all of them
+//
+// Return 0 if every thread ran, -1 if one could not be started
+static int run_workers(struct engine *engine, int n, void *(*fn)(void *)) {
+  pthread_t threads[n];
+  struct worker workers[n];
+  int started = 0;
+  for (int i = 0; i < n; i++) {
+    workers[i].engine = engine;
+    workers[i].id = i;
+    int err = pthread_create(&threads[i], NULL, fn, &workers[i]);
+    if (err != 0) {
+      fprintf(stderr, "pthread_create: %s\n", strerror(err));
+      engine_fail(engine);
+      break;
+    }
+    started++;
+  }
+  for (int i = 0; i < started; i++) {
+    pthread_join(threads[i], NULL);
+  }
+  return started == n ? 0 : -1;
+}
+
+static void engine_free(struct engine *engine) {
+  for (int m = 0; engine->runs && m < engine->n_mappers; m++)
+    free(engine->runs[m]);
+  for (int r = 0; engine->outs && r < engine->n_reducers; r++)
+    free(engine->outs[r]);
+  free(engine->runs);
+  free(engine->run_lens);
+  free(engine->bounds);
+  free(engine->outs);
+  free(engine->out_lens);
+  pthread_mutex_destroy(&engine->lock);
+}
+
+int run_threads(char *tasks[], int n_tasks, int n_mappers, int n_reducers,
+                int verbose) {
+  struct engine engine;
+  memset(&engine, 0, sizeof(engine));
+  engine.tasks = tasks;
+  engine.n_tasks = n_tasks;
+  engine.n_mappers = n_mappers;
+  engine.n_reducers = n_reducers;
+  pthread_mutex_init(&engine.lock, NULL);
+  engine.runs = calloc(n_mappers, sizeof(record_t *));
+  engine.run_lens = calloc(n_mappers, sizeof(size_t));
+  engine.bounds = calloc(n_reducers + 1, sizeof(uint64_t));
+  engine.outs = calloc(n_reducers, sizeof(record_t *));
+  engine.out_lens = calloc(n_reducers, sizeof(size_t));
+  if (!engine.runs || !engine.run_lens || !engine.bounds || !engine.outs ||
+      !engine.out_lens) {
+    fprintf(stderr, "malloc failed\n");
+    engine_free(&engine);
+    return -1;
+  }
+
+  if (run_workers(&engine, n_mappers, map_thread) != 0 || engine.failed) {
+    engine_free(&engine);
+    return -1;
+  }
+  if (verbose) {
+    for (int m = 0; m < n_mappers; m++)
+      fprintf(stderr, "mapreduce: mapper %d: %zu keys\n", m,
+              engine.run_lens[m]);
+  }
+
+  if (sample_bounds(&engine) != 0) {
+    fprintf(stderr, "malloc failed\n");
+    engine_free(&engine);
+    return -1;
+  }
+  if (run_workers(&engine, n_reducers, reduce_thread) != 0 || engine.failed) {
+    engine_free(&engine);
+    return -1;
+  }
+
+  for (int r = 0; r < n_reducers; r++) {
+    if (verbose) {
+      long long requests = 0;
+      for (size_t i = 0; i < engine.out_lens[r]; i++)
+        requests += engine.outs[r][i].requests;
+      fprintf(stderr, "mapreduce: reducer %d: %zu keys, %lld records\n", r,
+              engine.out_lens[r], requests);
+    }
+    if (records_print(stdout, engine.outs[r], engine.out_lens[r]) != 0) {
+      engine_free(&engine);
+      return -1;
+    }
+  }
+
+  engine_free(&engine);
+  return 0;
+}
@@ -0,0 +1,274 @@
+#include "./include/topk.h"
+
+#include <stdlib.h>
+#include <string.h>
+
+// Definition of a slot of the key index of a summary
+struct topk_slot {
+    uint32_t key;
+    int32_t pos;    // heap position of the counter of key, -1 if empty
+};
+
+topk_t *topk_init(size_t capacity) {
+  if (capacity == 0) {
+    return NULL;
+  }
+  topk_t *topk = calloc(1, sizeof(topk_t));
+  if (topk == NULL) {
+    return NULL;
+  }
+  topk->n_slots = 1;
+  while (topk->n_slots < capacity * 2) {
+    topk->n_slots <<= 1;
+  }
+  topk->entries = malloc(capacity * sizeof(topk_entry_t));
+  topk->slots = malloc(topk->n_slots * sizeof(struct topk_slot));
+  if (topk->entries == NULL || topk->slots == NULL) {
+    topk_free(topk);
+    return NULL;
+  }
+  for (size_t i = 0; i < topk->n_slots; i++) {
+    topk->slots[i].pos = -1;
+  }
+  topk->capacity = capacity;
+  return topk;
+}
+
+void topk_free(topk_t *topk) {
+  if (topk == NULL) {
+    return;
+  }
+  free(topk->entries);
+  free(topk->slots);
+  free(topk);
+}
+
+// Return the slot of key, or the empty slot where it would go
+static size_t topk_find(const topk_t *topk, uint32_t key) {
+  size_t mask = topk->n_slots - 1;
+  size_t pos = hash_key(key) & mask;
+  while (topk->slots[pos].pos >= 0 && topk->slots[pos].key != key) {
+    pos = (pos + 1) & mask;
+  }
+  return pos;
+}
+
+// Empty the slot at pos and shift later entries of its probe run back,
+// so no lookup ever stops early at the hole
+static void topk_unlink(topk_t *topk, size_t pos) {
+  size_t mask = topk->n_slots - 1;
+  size_t next = (pos + 1) & mask;
+  while (topk->slots[next].pos >= 0) {
+    size_t home = hash_key(topk->slots[next].key) & mask;
+    // move the entry back unless its home lies in (pos, next]
+    if (((next - home) & mask) >= ((next - pos) & mask)) {
+      topk->slots[pos] = topk->slots[next];
+      pos = next;
+    }
+    next = (next + 1) & mask;
+  }
+  topk->slots[pos].pos = -1;
+}
+
+// Move the counter at heap position i down until neither child has a
+// smaller count, keeping the key index in step
+static void topk_sift_down(topk_t *topk, size_t i) {
+  topk_entry_t entry = topk->entries[i];
+  for (;;) {
+    size_t child = 2 * i + 1;
+    if (child >= topk->count) {
+      break;
+    }
+    if (child + 1 < topk->count &&
+        topk->entries[child + 1].count < topk->entries[child].count) {
+      child++;
+    }
+    if (topk->entries[child].count >= entry.count) {
+      break;
+    }
+    topk->entries[i] = topk->entries[child];
+    topk->slots[topk_find(topk, topk->entries[i].key)].pos = (int32_t)i;
+    i = child;
+  }
+  topk->entries[i] = entry;
+  topk->slots[topk_find(topk, entry.key)].pos = (int32_t)i;
+}
+
+// Move the counter at heap position i up while its parent has a larger
+// count
+static void topk_sift_up(topk_t *topk, size_t i) {
+  topk_entry_t entry = topk->entries[i];
+  while (i > 0 && topk->entries[(i - 1) / 2].count > entry.count) {
+    topk->entries[i] = topk->entries[(i - 1) / 2];
+    topk->slots[topk_find(topk, topk->entries[i].key)].pos = (int32_t)i;
+    i = (i - 1) / 2;
+  }
+  topk->entries[i] = entry;
+  topk->slots[topk_find(topk, entry.key)].pos = (int32_t)i;
+}
+
+int topk_add(topk_t *topk, uint32_t key, int requests) {
+  if (topk == NULL || requests < 0) {
+    return -1;
+  }
+  size_t slot = topk_find(topk, key);
+  if (topk->slots[slot].pos >= 0) {
+    size_t i = (size_t)topk->slots[slot].pos;
+    topk->entries[i].count += requests;
+    topk_sift_down(topk, i);
+    return 0;
+  }
+
+  if (topk->count < topk->capacity) {
+    topk->slots[slot].key = key;
+    topk->slots[slot].pos = (int32_t)topk->count;
+    topk->entries[topk->count++] = (topk_entry_t){key, requests, 0};
+    topk_sift_up(topk, topk->count - 1);
+    return 0;
+  }
+
+  // take over the smallest counter, its count bounds what key may have
+  // had before
+  topk_unlink(topk, topk_find(topk, topk->entries[0].key));
+  slot = topk_find(topk, key);
+  topk->slots[slot].key = key;
+  topk->slots[slot].pos = 0;
+  int floor = topk->entries[0].count;
+  topk->entries[0] = (topk_entry_t){key, floor + requests, floor};
+  topk_sift_down(topk, 0);
+  return 0;
+}
+
+uint32_t topk_floor(const topk_t *topk) {
+  if (topk == NULL || topk->count < topk->capacity) {
+    return 0;
+  }
+  return (uint32_t)topk->entries[0].count;
+}
+
+static int cmp_entry_key(const void *a, const void *b) {
+  uint32_t ka = ((const topk_entry_t *)a)->key;
+  uint32_t kb = ((const topk_entry_t *)b)->key;
+  return (ka > kb) - (ka < kb);
+}
+
+// Order entries by count, largest first, then by key
+static int cmp_entry_count(const void *a, const void *b) {
+  const topk_entry_t *ea = a;
+  const topk_entry_t *eb = b;
+  if (ea->count != eb->count) {
+    return ea->count > eb->count ? -1 : 1;
+  }
+  return (ea->key > eb->key) - (ea->key < eb->key);
+}
+
+int topk_write(const char out_file[MAX_PATH], const topk_entry_t *entries,
+               size_t count, uint32_t floor) {
+  if (out_file == NULL || (entries == NULL && count > 0)) {
+    return -1;
+  }
+  table_header_t header;
+  table_header_init(&header, TABLE_KEY_TOPK);
+  header.floor = floor;
+  return table_write(out_file, &header, entries, count, sizeof(topk_entry_t));
+}
+
+int topk_to_file(topk_t *topk, const char out_file[MAX_PATH]) {
+  if (topk == NULL) {
+    return -1;
+  }
+  uint32_t floor = topk_floor(topk);
+  qsort(topk->entries, topk->count, sizeof(topk_entry_t), cmp_entry_key);
+  return topk_write(out_file, topk->entries, topk->count, floor);
+}
+
+topk_entry_t *topk_read_range(const char in_file[MAX_PATH], uint64_t start,
+                              uint64_t end, size_t *count, uint32_t *floor) {
+  table_header_t header;
+  topk_entry_t *entries =
+      table_read_keys(in_file, TABLE_KEY_TOPK, sizeof(topk_entry_t), start,
+                      end, &header, count);
+  if (entries != NULL) {
+    *floor = header.floor;
+  }
+  return entries;
+}
+
+topk_entry_t *topk_merge(topk_entry_t *entries[], const size_t counts[],
+                         const uint32_t floors[], size_t n, size_t capacity,
+                         size_t *count, uint32_t *floor) {
+  size_t total = 0;
+  long long floor_sum = 0;
+  for (size_t s = 0; s < n; s++) {
+    total += counts[s];
+    floor_sum += floors[s];
+  }
+  topk_entry_t *merged = malloc((total ? total : 1) * sizeof(topk_entry_t));
+  size_t *next = calloc(n ? n : 1, sizeof(size_t));
+  if (merged == NULL || next == NULL) {
+    free(merged);
+    free(next);
+    return NULL;
+  }
+
+  // walk the sorted summaries side by side, one distinct key at a time
+  size_t m = 0;
+  for (;;) {
+    uint64_t key = KEY_SPACE;
+    for (size_t s = 0; s < n; s++) {
+      if (next[s] < counts[s] && entries[s][next[s]].key < key) {
+        key = entries[s][next[s]].key;
+      }
+    }
+    if (key == KEY_SPACE) {
+      break;
+    }
+    long long c = 0, e = 0;
+    for (size_t s = 0; s < n; s++) {
+      if (next[s] < counts[s] && entries[s][next[s]].key == key) {
+        c += entries[s][next[s]].count;
+        e += entries[s][next[s]].error;
+        next[s]++;
+      } else {
+        c += floors[s];
+        e += floors[s];
+      }
+    }
+    merged[m].key = (uint32_t)key;
+    merged[m].count = c > INT32_MAX ? INT32_MAX : (int)c;
+    merged[m].error = e > INT32_MAX ? INT32_MAX : (int)e;
+    m++;
+  }
+  free(next);
+
+  // a key found in no summary has at most floor_sum, one that is dropped
+  // at most its own count
+  *floor = floor_sum > UINT32_MAX ? UINT32_MAX : (uint32_t)floor_sum;
+  if (m > capacity) {
+    qsort(merged, m, sizeof(topk_entry_t), cmp_entry_count);
+    if ((uint32_t)merged[capacity].count > *floor) {
+      *floor = (uint32_t)merged[capacity].count;
+    }
+    m = capacity;
+    qsort(merged, m, sizeof(topk_entry_t), cmp_entry_key);
+  }
+  *count = m;
+  return merged;
+}
+
+int topk_print(FILE *fp, topk_entry_t *entries, size_t count, size_t n) {
+  qsort(entries, count, sizeof(topk_entry_t), cmp_entry_count);
+  if (n > count) {
+    n = count;
+  }
+  for (size_t i = 0; i < n; i++) {
+    char ip[IP_LEN];
+    key_to_ip(entries[i].key, ip);
+    if (fprintf(fp, "%s - %d error=%d\n", ip, entries[i].count,
+                entries[i].error) < 0) {
+      perror("fprintf");
+      return -1;
+    }
+  }
+  return 0;
+}